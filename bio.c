@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -9,6 +9,9 @@
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
+// * To have several disk operations in flight at once, start
+//     each with bsubmit or bwritestart and wait for each with
+//     bwait before calling brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
@@ -17,44 +20,237 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Each hash bucket has its own lock, guarding the bucket's list
+// and the identity and refcnt of its buffers, so that lookups of
+// blocks in different buckets do not contend.  bcache.lock
+// serializes misses, and only bshrink() holds more than one
+// bucket lock.  Buffers holding a block with refcnt==0 are also
+// on a list, most recently released first, guarded by
+// bcache.lrulock, which is taken after a bucket lock.
+//
+// The cache grows a page of buffer data at a time, from kalloc(),
+// while memory is plentiful, up to 1/BCACHEFRAC of memory.  When
+// it cannot grow, a miss recycles the unused buffer released
+// longest ago, from the tail of the list.  kallocswap() shrinks
+// the cache under memory pressure, down to NBUF buffers, before
+// swapping.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13
+#define BPP (PGSIZE/BSIZE)  // buffers per page of data
+#define BFREEMIN 1024       // free pages the cache leaves when growing
+
+// A page of buffer data and the buffers using it.
+struct bgroup {
+  struct bgroup *next;
+  char *page;
+  struct buf buf[BPP];
+};
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;      // buffers hashed here, through next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes misses, growing and shrinking
+  struct bucket bucket[NBUCKET];
+  struct spinlock lrulock;
+  struct buf lru;        // head of the list of unused buffers
+  struct buf *free;      // buffers holding no block, through next
+  struct bgroup *group;  // groups in the cache
+  struct bgroup *freegroup;
+  int ngroup;
+  int mingroup;
+  int maxgroup;
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev*31 + blockno) % NBUCKET];
+}
+
+// Add a page of buffers to the free list.  Returns 0 on
+// success, -1 if out of memory.  Caller holds bcache.lock.
+static int
+bgrow(void)
+{
+  struct bgroup *g;
+  char *mem;
+  int i;
+
+  if(bcache.freegroup == 0){
+    // Carve a page into group structures, which are never freed.
+    if((mem = kalloc()) == 0)
+      return -1;
+    for(i = 0; i + sizeof(*g) <= PGSIZE; i += sizeof(*g)){
+      g = (struct bgroup*)(mem + i);
+      g->next = bcache.freegroup;
+      bcache.freegroup = g;
+    }
+  }
+  g = bcache.freegroup;
+  if((g->page = kalloc()) == 0)
+    return -1;
+  bcache.freegroup = g->next;
+  for(i = 0; i < BPP; i++){
+    initsleeplock(&g->buf[i].lock, "buffer");
+    g->buf[i].dev = -1;
+    g->buf[i].refcnt = 0;
+    g->buf[i].flags = 0;
+    g->buf[i].data = (uchar*)g->page + i*BSIZE;
+    g->buf[i].next = bcache.free;
+    bcache.free = &g->buf[i];
+  }
+  g->next = bcache.group;
+  bcache.group = g;
+  bcache.ngroup++;
+  return 0;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  initlock(&bcache.lrulock, "bcache.lru");
+  bcache.lru.lprev = &bcache.lru;
+  bcache.lru.lnext = &bcache.lru;
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  bcache.mingroup = (NBUF + BPP - 1) / BPP;
+  bcache.maxgroup = PHYSTOP / PGSIZE / BCACHEFRAC;
+  while(bcache.ngroup < bcache.mingroup)
+    if(bgrow() < 0)
+      panic("binit");
+}
+
+// Return the buffer in bk holding the block, or 0.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Remove b from its bucket's list.
+// Caller must hold the bucket's lock.
+static void
+bunhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+}
+
+// Take b off the list of unused buffers.
+// Caller must hold bcache.lrulock.
+static void
+lruremove(struct buf *b)
+{
+  b->lnext->lprev = b->lprev;
+  b->lprev->lnext = b->lnext;
+}
+
+// Take a reference to b.
+// Caller must hold the lock of b's bucket.
+static void
+bref(struct buf *b)
+{
+  if(b->refcnt++ == 0){
+    acquire(&bcache.lrulock);
+    lruremove(b);
+    release(&bcache.lrulock);
   }
 }
 
+// Unhash the unused buffer released longest ago and return
+// it, or 0 if every buffer is in use.  Caller holds bcache.lock,
+// so the buffer chosen can be taken by hits but not recycled.
+// Even if refcnt==0, B_DIRTY indicates a buffer is in use
+// because log.c has modified it but not yet committed it.
+static struct buf*
+brecycle(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  for(;;){
+    acquire(&bcache.lrulock);
+    for(b = bcache.lru.lprev; b != &bcache.lru; b = b->lprev)
+      if((b->flags & B_DIRTY) == 0)
+        break;
+    release(&bcache.lrulock);
+    if(b == &bcache.lru)
+      return 0;
+    // Take the locks in order, then make sure a hit has
+    // not taken the buffer meanwhile.
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0){
+      acquire(&bcache.lrulock);
+      lruremove(b);
+      release(&bcache.lrulock);
+      bunhash(bk, b);
+      release(&bk->lock);
+      return b;
+    }
+    release(&bk->lock);
+  }
+}
+
+// Give a buffer for the block, which is not cached, a free
+// buffer, growing the cache for one if memory allows, or else
+// a recycled one.  Returns the buffer, referenced but not
+// locked, or 0 if every buffer is in use.
+// Caller holds bcache.lock.
+static struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  if(bcache.free == 0 && bcache.ngroup < bcache.maxgroup &&
+     kfreecount() > BFREEMIN)
+    bgrow();
+  if((b = bcache.free) != 0)
+    bcache.free = b->next;
+  else if((b = brecycle()) == 0)
+    return 0;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->iodone = 0;
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  return b;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
@@ -62,34 +258,100 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
 
-  acquire(&bcache.lock);
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bk, dev, blockno)) != 0){
+    bref(b);
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Not cached.  Look again now that no other miss can
+  // be adding it.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    bref(b);
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  if((b = bnew(dev, blockno)) == 0)
+    panic("bget: no buffers");
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Give up to n pages of buffers back to kalloc(), taking
+// pages none of whose buffers are in use.  Returns the
+// number of pages freed.
+int
+bshrink(int n)
+{
+  struct bgroup *g, **pp;
+  struct bucket *bk;
+  struct buf *b, **fp;
+  int i, freed;
+
+  acquire(&bcache.lock);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    acquire(&bk->lock);
+  acquire(&bcache.lrulock);
+  freed = 0;
+  pp = &bcache.group;
+  while((g = *pp) != 0 && freed < n && bcache.ngroup > bcache.mingroup){
+    for(i = 0; i < BPP; i++)
+      if(g->buf[i].refcnt != 0 || (g->buf[i].flags & B_DIRTY))
+        break;
+    if(i < BPP){
+      pp = &g->next;
+      continue;
     }
+    for(i = 0; i < BPP; i++){
+      b = &g->buf[i];
+      if(b->dev != -1){
+        bunhash(bhash(b->dev, b->blockno), b);
+        lruremove(b);
+        continue;
+      }
+      for(fp = &bcache.free; *fp != b; fp = &(*fp)->next)
+        ;
+      *fp = b->next;
+    }
+    *pp = g->next;
+    kfree(g->page);
+    g->next = bcache.freegroup;
+    bcache.freegroup = g;
+    bcache.ngroup--;
+    freed++;
   }
-  panic("bget: no buffers");
+  release(&bcache.lrulock);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    release(&bk->lock);
+  release(&bcache.lock);
+  return freed;
+}
+
+static void bput(struct buf*);
+
+// Read-ahead is done: let go of the buffer, on behalf of the
+// process that started it.  Called from the disk driver's
+// completion path.
+static void
+bahead(struct buf *b)
+{
+  b->iodone = 0;
+  bput(b);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -115,30 +377,100 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Start syncing locked buffer b with disk, without waiting:
+// write it if B_DIRTY is set, else read it.  If done is set,
+// it is called from the disk interrupt when the I/O finishes.
+// b must stay locked until then, and must be waited for with
+// bwait before brelse if done does not release it.
+void
+bsubmit(struct buf *b, void (*done)(struct buf*))
+{
+  if(!holdingsleep(&b->lock))
+    panic("bsubmit");
+  b->iodone = done;
+  idesubmit(b);
+}
+
+// Start writing b's contents to disk.  Must be locked.
+void
+bwritestart(struct buf *b)
+{
+  b->flags |= B_DIRTY;
+  bsubmit(b, 0);
+}
+
+// Wait for the I/O bsubmit started on b to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  idecomplete(b);
+}
+
+// Start reading the block into the cache, unless it is
+// cached already, without waiting for the disk.  Does
+// nothing if every buffer is in use.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  bk = bhash(dev, blockno);
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b || (b = bnew(dev, blockno)) == 0){
+    release(&bcache.lock);
+    return;
+  }
+  release(&bcache.lock);
+  // A reader of the block waits on the lock until the
+  // disk is done and bahead() lets go of it.  One may have
+  // locked it first, though, and read it and even changed it.
+  acquiresleep(&b->lock);
+  if(b->flags & B_VALID){
+    bput(b);
+    return;
+  }
+  bsubmit(b, bahead);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Once no one is using it, it may be recycled,
+// least recently released first.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
+  bput(b);
+}
+
+// Unlock b and drop a reference to it.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    acquire(&bcache.lrulock);
+    b->lnext = bcache.lru.lnext;
+    b->lprev = &bcache.lru;
+    bcache.lru.lnext->lprev = b;
+    bcache.lru.lnext = b;
+    release(&bcache.lrulock);
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 //PAGEBREAK!
 // Blank page.
-
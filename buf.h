@@ -4,10 +4,13 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  struct buf *next; // hash bucket list
+  struct buf *lprev; // list of unused buffers (see bio.c)
+  struct buf *lnext;
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uint qtime;       // ticks when queued (see elevator.c)
+  void (*iodone)(struct buf*); // if set, called when the disk finishes
+  uchar *data;      // BSIZE bytes (see bio.c)
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
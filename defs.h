@@ -1,20 +1,31 @@
 struct buf;
 struct context;
+struct elevator;
+struct elevq;
 struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct pstat;
+struct rmap;
 struct rtcdate;
+struct shm;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
+int             bshrink(int);
+void            breadahead(uint, uint);
+void            bsubmit(struct buf*, void (*)(struct buf*));
+void            bwait(struct buf*);
 void            bwrite(struct buf*);
+void            bwritestart(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -22,6 +33,11 @@ void            cprintf(char*, ...);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// elevator.c
+void            elvinit(struct elevq*, struct elevator*);
+void            elvadd(struct elevq*, struct buf*);
+struct buf*     elvnext(struct elevq*, int);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -30,6 +46,10 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+int             fdalloc(struct file*);
+struct file*    fdget(int);
+struct file*    fdremove(int);
+void            fdcopy(struct proc*);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
@@ -40,6 +60,8 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   idupcwd(void);
+void            setcwd(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -53,10 +75,17 @@ int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
+// futex.c
+void            futexinit(void);
+int             futex(uint, int, int);
+int             futexwaiting(struct proc*, uint);
+
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
+void            idecomplete(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -65,7 +94,18 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kzalloc(void);
+void            kzerofill(void);
+char*           kzeropage(void);
+int             kfreecount(void);
 void            kfree(char*);
+void            kincref(char*);
+int             krefcount(char*);
+int             rmapadd(char*, pde_t*, uint);
+void            rmapremove(char*, pde_t*, uint);
+int             rmapget(char*, struct rmap*, int);
+char*           lrunext(void);
+int             lrusize(void);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -79,6 +119,7 @@ extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
+void            lapicipi(int, int);
 void            microdelay(int);
 
 // log.c
@@ -87,10 +128,24 @@ void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
 
+// mmap.c
+int             mmap(uint, int, int, struct file*, uint);
+int             munmap(uint, uint);
+int             vmaoverlap(struct proc*, uint, uint);
+void            vmadup(struct proc*, struct proc*);
+void            vmafree(struct proc*);
+int             vmashare(struct proc*);
+
 // mp.c
 extern int      ismp;
 void            mpinit(void);
 
+// pci.c
+int             pcifind(int, int);
+int             pcifindid(int, int);
+uint            pciread(int, int);
+void            pciwrite(int, int, uint);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
@@ -107,6 +162,15 @@ int             cpuid(void);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
+void            lockvm(struct proc*);
+void            unlockvm(struct proc*);
+int             clone(uint, uint, uint);
+int             join(uint);
+int             livethreads(struct proc*);
+int             pstat(struct pstat*, int);
+struct proc*    lockpgdir(pde_t*);
+int             pinned(struct proc*, uint, uint);
+void            pinuvm(uint, uint);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
@@ -121,6 +185,26 @@ int             wait(void);
 void            wakeup(void*);
 void            yield(void);
 
+// shm.c
+void            shminit(void);
+int             shmopen(int, uint);
+int             shmattach(int);
+int             shmdetach(uint);
+void            shmdup(struct shm*);
+void            shmclose(struct shm*);
+char*           shmpage(struct shm*, uint, char*);
+int             shmanon(struct proc*, struct vma*);
+
+// swap.c
+void            swapinit(int);
+int             swapalloc(void);
+void            swapdup(uint);
+void            swapfree(uint);
+void            swapread(char*, uint);
+void            swapwrite(char*, uint);
+int             swapout(int);
+char*           kallocswap(int);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
@@ -151,6 +235,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argoutptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -170,21 +255,36 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+extern int      virtioirq;
+int             virtioinit(void);
+void            virtiointr(void);
+void            virtiosubmit(struct buf*);
+void            virtiocomplete(struct buf*);
+
 // vm.c
 void            seginit(void);
 void            kvmalloc(void);
+void            pgeinit(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(struct proc*);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
+void            tlbflush(pde_t*, uint, uint);
+void            tlbintr(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+int             pagefault(uint, uint);
+int             faultuvm(struct proc*, uint, uint, int);
+char*           uvmdirty(pde_t*, uint);
+struct vma*     findvma(struct proc*, uint);
+int             evictpage(char*);
+void            uvmstat(pde_t*, struct pstat*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
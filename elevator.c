@@ -0,0 +1,169 @@
+// I/O schedulers.
+//
+// A disk driver keeps the requests it has not started yet in an
+// elevq, and the queue's scheduler picks which to start next.
+// The drivers use IOSCHED, set in param.h.  There are two:
+//
+// * elvfifo starts requests in the order they arrive.
+//
+// * elvclook is a C-LOOK elevator.  It keeps requests sorted by
+//   disk and block, and starts them in one upward sweep from
+//   the position of the last request started, then jumps back
+//   to the lowest.  Interleaved streams of requests thus cost
+//   fewer seeks.  A read that has waited READEXPIRE ticks is
+//   started next, ahead of the sweep, so that a stream of
+//   writes ahead of the head cannot hold up a reader for long.
+//
+// Whichever scheduler is used, elvnext() merges queued requests
+// for the blocks after the one it picks into one disk request,
+// so that a driver can move a run of blocks in one command.
+//
+// The driver's lock protects the queue.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "elevator.h"
+
+#define READEXPIRE 20  // ticks a read waits before jumping the queue
+
+void
+elvinit(struct elevq *q, struct elevator *el)
+{
+  q->el = el;
+  q->head = 0;
+  q->dev = 0;
+  q->pos = 0;
+}
+
+// Queue request b.
+void
+elvadd(struct elevq *q, struct buf *b)
+{
+  b->qtime = ticks;
+  q->el->add(q, b);
+}
+
+// Can b be merged onto the end of a request ending with a?
+static int
+mergeable(struct buf *a, struct buf *b)
+{
+  return b->dev == a->dev && b->blockno == a->blockno + 1 &&
+    (b->flags & B_DIRTY) == (a->flags & B_DIRTY);
+}
+
+// Remove and return the request to start next, or 0 if the
+// queue is empty.  Queued requests for the blocks after it,
+// on the same disk and in the same direction, are merged into
+// it, up to max bufs: they are chained on by qnext.
+struct buf*
+elvnext(struct elevq *q, int max)
+{
+  struct buf *b, *last, **pp;
+  int n;
+
+  if((b = q->el->next(q)) == 0)
+    return 0;
+  last = b;
+  for(n = 1; n < max; n++){
+    for(pp = &q->head; *pp; pp = &(*pp)->qnext)
+      if(mergeable(last, *pp))
+        break;
+    if(*pp == 0)
+      break;
+    last->qnext = *pp;
+    *pp = (*pp)->qnext;
+    last = last->qnext;
+  }
+  last->qnext = 0;
+  q->dev = last->dev;
+  q->pos = last->blockno + 1;
+  return b;
+}
+
+// Remove b from q.
+static void
+unlink(struct elevq *q, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &q->head; *pp != b; pp = &(*pp)->qnext)
+    ;
+  *pp = b->qnext;
+}
+
+static void
+fifoadd(struct elevq *q, struct buf *b)
+{
+  struct buf **pp;
+
+  b->qnext = 0;
+  for(pp = &q->head; *pp; pp = &(*pp)->qnext)
+    ;
+  *pp = b;
+}
+
+static struct buf*
+fifonext(struct elevq *q)
+{
+  struct buf *b;
+
+  if((b = q->head) != 0)
+    q->head = b->qnext;
+  return b;
+}
+
+struct elevator elvfifo = { "fifo", fifoadd, fifonext };
+
+// Does block bn1 of dev1 come before block bn2 of dev2?
+static int
+before(uint dev1, uint bn1, uint dev2, uint bn2)
+{
+  return dev1 < dev2 || (dev1 == dev2 && bn1 < bn2);
+}
+
+static void
+clookadd(struct elevq *q, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &q->head; *pp; pp = &(*pp)->qnext)
+    if(before(b->dev, b->blockno, (*pp)->dev, (*pp)->blockno))
+      break;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+static struct buf*
+clooknext(struct elevq *q)
+{
+  struct buf *b, *old;
+
+  if(q->head == 0)
+    return 0;
+
+  // The oldest read, if it has waited too long.
+  old = 0;
+  for(b = q->head; b; b = b->qnext)
+    if(!(b->flags & B_DIRTY) && (old == 0 || b->qtime < old->qtime))
+      old = b;
+  if(old && ticks - old->qtime >= READEXPIRE){
+    unlink(q, old);
+    return old;
+  }
+
+  // The first request at or after the head, or else the lowest.
+  for(b = q->head; b; b = b->qnext)
+    if(!before(b->dev, b->blockno, q->dev, q->pos))
+      break;
+  if(b == 0)
+    b = q->head;
+  unlink(q, b);
+  return b;
+}
+
+struct elevator elvclook = { "clook", clookadd, clooknext };
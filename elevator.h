@@ -0,0 +1,21 @@
+// I/O schedulers: see elevator.c.
+
+struct buf;
+struct elevq;
+
+struct elevator {
+  char *name;
+  void (*add)(struct elevq*, struct buf*);
+  struct buf* (*next)(struct elevq*);
+};
+
+// A disk driver's queue of requests not yet started.
+struct elevq {
+  struct elevator *el;   // scheduler ordering the queue
+  struct buf *head;      // linked by qnext
+  uint dev;              // disk position: after the block
+  uint pos;              //   last started
+};
+
+extern struct elevator elvfifo;
+extern struct elevator elvclook;
@@ -6,19 +6,25 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "mman.h"
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
+  // The other threads would lose their address space.
+  if(curproc->leader != curproc || livethreads(curproc) > 0)
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -28,6 +34,7 @@ exec(char *path, char **argv)
   }
   ilock(ip);
   pgdir = 0;
+  nvma = 0;
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -38,7 +45,8 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where each program segment comes from in the file;
+  // pagefault() reads its pages in as the program touches them.
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -49,12 +57,27 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz >= KERNBASE)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.memsz == 0)
+      continue;
+    if(nvma >= NVMA)
       goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = PGROUNDUP(ph.vaddr + ph.memsz);
+    vma[nvma].ip = idup(ip);
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    vma[nvma].prot = PROT_READ|PROT_WRITE;
+    vma[nvma].flags = MAP_PRIVATE;
+    vma[nvma].shm = 0;
+    nvma++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -94,6 +117,10 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  lockvm(curproc);
+  vmafree(curproc);
+  for(i = 0; i < nvma; i++)
+    curproc->vma[i] = vma[i];
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
@@ -101,6 +128,7 @@ exec(char *path, char **argv)
   curproc->tf->esp = sp;
   switchuvm(curproc);
   freevm(oldpgdir);
+  unlockvm(curproc);
   return 0;
 
  bad:
@@ -110,5 +138,11 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(nvma > 0){
+    begin_op();
+    for(i = 0; i < nvma; i++)
+      iput(vma[i].ip);
+    end_op();
+  }
   return -1;
 }
@@ -5,6 +5,8 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
@@ -130,7 +132,7 @@ filewrite(struct file *f, char *addr, int n)
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -155,3 +157,79 @@ filewrite(struct file *f, char *addr, int n)
   panic("filewrite");
 }
 
+// Threads share the descriptor table of their group leader;
+// ftable.lock guards it, so that threads opening and closing
+// files at once do not step on each other.
+
+// Allocate a file descriptor for the given file.
+// Takes over file reference from caller on success.
+int
+fdalloc(struct file *f)
+{
+  int fd;
+  struct proc *mm = myproc()->leader;
+
+  acquire(&ftable.lock);
+  for(fd = 0; fd < NOFILE; fd++){
+    if(mm->ofile[fd] == 0){
+      mm->ofile[fd] = f;
+      release(&ftable.lock);
+      return fd;
+    }
+  }
+  release(&ftable.lock);
+  return -1;
+}
+
+// Return the file open as descriptor fd, or 0.  Another
+// thread may close fd while the system call uses the file,
+// so the file gets an extra reference, which syscall() drops
+// when the call returns.  A system call can do this up to
+// NARGFILE times; after that, fdget() returns 0.
+struct file*
+fdget(int fd)
+{
+  struct proc *curproc = myproc();
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE || curproc->nargfile == NARGFILE)
+    return 0;
+  acquire(&ftable.lock);
+  if((f = curproc->leader->ofile[fd]) != 0)
+    f->ref++;
+  release(&ftable.lock);
+  if(f)
+    curproc->argfile[curproc->nargfile++] = f;
+  return f;
+}
+
+// Remove descriptor fd and return the file it referred to,
+// whose reference passes to the caller, or 0.
+struct file*
+fdremove(int fd)
+{
+  struct proc *mm = myproc()->leader;
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&ftable.lock);
+  f = mm->ofile[fd];
+  mm->ofile[fd] = 0;
+  release(&ftable.lock);
+  return f;
+}
+
+// Give fork child np the descriptors of the current process.
+void
+fdcopy(struct proc *np)
+{
+  struct proc *mm = myproc()->leader;
+  int fd;
+
+  acquire(&ftable.lock);
+  for(fd = 0; fd < NOFILE; fd++)
+    if((np->ofile[fd] = mm->ofile[fd]) != 0)
+      np->ofile[fd]->ref++;
+  release(&ftable.lock);
+}
@@ -16,6 +16,9 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // block a sequential reader reads next
+  uint raend;         // blocks before this have been read ahead
+  uint rawin;         // read-ahead window, in blocks
 
   short type;         // copy of disk inode
   short major;
@@ -0,0 +1,26 @@
+// Physical page frames.  kalloc.c keeps one struct frame per
+// page of physical memory, indexed by physical page number.
+
+// A page table entry that maps a frame.
+struct rmap {
+  pde_t *pgdir;
+  uint va;
+  struct rmap *next;
+};
+
+// A page kalloc.c carves into rmap entries (F_RMAP) uses its
+// frame's rmap for its free entries, nrmap for the number in
+// use, and prev and next for the list of such pages that have
+// free entries.
+struct frame {
+  uchar ref;             // holders: page tables mapping it, shm segments, ...
+  uchar flags;
+  ushort nrmap;          // F_RMAP: entries in use
+  struct rmap *rmap;     // user PTEs mapping the frame
+  struct frame *prev;    // LRU list of mapped user frames
+  struct frame *next;
+};
+
+#define F_LRU  0x1       // on the LRU list
+#define F_ZERO 0x2       // the zero page (see kalloc.c)
+#define F_RMAP 0x4       // holds rmap entries
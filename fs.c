@@ -23,6 +23,7 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void readahead(struct inode*, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -36,6 +37,8 @@ readsb(int dev, struct superblock *sb)
   bp = bread(dev, 1);
   memmove(sb, bp->data, sizeof(*sb));
   brelse(bp);
+  if(sb->bsize != BSIZE)
+    panic("readsb: file system has another block size");
 }
 
 // Zero a block.
@@ -266,6 +269,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = ip->raend = ip->rawin = 0;
   release(&icache.lock);
 
   return ip;
@@ -282,6 +286,37 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Return a new reference to the current directory, which
+// another thread's chdir() may be replacing: threads share
+// their group leader's.
+struct inode*
+idupcwd(void)
+{
+  struct inode *ip;
+
+  acquire(&icache.lock);
+  ip = myproc()->leader->cwd;
+  ip->ref++;
+  release(&icache.lock);
+  return ip;
+}
+
+// Make ip, whose reference passes from the caller, the
+// current directory, dropping the old one's.  Must be called
+// inside a transaction, in case that was the last reference.
+void
+setcwd(struct inode *ip)
+{
+  struct proc *mm = myproc()->leader;
+  struct inode *old;
+
+  acquire(&icache.lock);
+  old = mm->cwd;
+  mm->cwd = ip;
+  release(&icache.lock);
+  iput(old);
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -471,10 +506,41 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
+    readahead(ip, off/BSIZE);
   }
   return n;
 }
 
+// Read-ahead.  While readi() reads an inode block after
+// block, the window of blocks read ahead of the reader grows
+// from RAMIN up to RAMAX, doubling on each sequential read;
+// a seek shuts it until the reader is sequential again.
+#define RAMIN 2
+#define RAMAX 32
+
+// The reader has just read block bn of ip.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint end;
+
+  if(bn+1 == ip->ranext)
+    return;  // the rest of the same block
+  if(bn == ip->ranext)
+    ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  else {
+    ip->rawin = 0;
+    ip->raend = bn+1;
+  }
+  ip->ranext = bn+1;
+  if(ip->raend < bn+1)
+    ip->raend = bn+1;
+  end = min(bn+1+ip->rawin, (ip->size+BSIZE-1)/BSIZE);
+  for(; ip->raend < end; ip->raend++)
+    breadahead(ip->dev, bmap(ip, ip->raend));
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
@@ -629,7 +695,7 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idupcwd();
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -3,11 +3,18 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#ifndef BSIZE
+#define BSIZE 512  // block size; set with make BSIZE=...
+#endif
+#if BSIZE < 512 || BSIZE > 4096 || (BSIZE & (BSIZE-1)) != 0
+#error "BSIZE must be a power of two from 512 to 4096"
+#endif
+#define PGBLOCKS (4096/BSIZE)  // blocks per page of swap space
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
+// followed by the swap area, outside the file system.
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -19,6 +26,9 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of pages of swap space
+  uint bsize;        // Block size (bytes)
 };
 
 #define NDIRECT 12
@@ -0,0 +1,200 @@
+// Fast user-space locking: futex(addr, op, val).
+//
+// FUTEX_WAIT puts the caller to sleep if the int at addr still
+// holds val; FUTEX_WAKE wakes up to val processes sleeping on
+// addr.  User locks need the kernel only when contended.
+//
+// Sleepers are kept on hashed queues by key.  The int in a
+// MAP_SHARED region (which includes shm segments) is keyed by
+// its physical address, so processes that share the memory can
+// wait on each other: such pages are never copy-on-write or
+// swapped out, so the int stays put.  Any other int is keyed by
+// its address space and user address, which a copy-on-write
+// copy or a trip through swap leaves unchanged; only threads
+// of one process wait on it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "mman.h"
+#include "futex.h"
+
+#define NFUTEXQ 64
+
+struct futexkey {
+  struct proc *mm;        // group leader, or 0 if shared
+  uint addr;              // user address, or physical if shared
+};
+
+// A process sleeping in FUTEX_WAIT, on its kernel stack.
+struct waiter {
+  struct futexkey key;    // int waited on
+  int woken;
+  struct waiter *next;
+};
+
+struct futexq {
+  struct spinlock lock;
+  struct waiter *head;
+};
+
+static struct futexq futexq[NFUTEXQ];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEXQ; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+static struct futexq*
+hashq(struct futexkey *k)
+{
+  return &futexq[(((uint)k->mm ^ k->addr) >> 2) % NFUTEXQ];
+}
+
+// Find the int at user address addr, making its page present,
+// and its key.  Returns the kernel address of the int, or 0.
+// The caller must hold the address space lock, which keeps the
+// page from being freed or swapped out.
+static int*
+futexaddr(uint addr, struct futexkey *k)
+{
+  struct proc *mm = myproc()->leader;
+  struct vma *v;
+  char *ka;
+
+  if(addr % 4 != 0 || addr >= KERNBASE)
+    return 0;
+  if(faultuvm(mm, addr, 4, 0) < 0)
+    return 0;
+  if((ka = uva2ka(mm->pgdir, (char*)addr)) == 0)
+    return 0;
+  ka += addr % PGSIZE;
+  if((v = findvma(mm, addr)) != 0 && (v->flags & MAP_SHARED)){
+    k->mm = 0;
+    k->addr = V2P(ka);
+  } else {
+    k->mm = mm;
+    k->addr = addr;
+  }
+  return (int*)ka;
+}
+
+static int
+samekey(struct futexkey *a, struct futexkey *b)
+{
+  return a->mm == b->mm && a->addr == b->addr;
+}
+
+static int
+futexwait(uint addr, int val)
+{
+  struct proc *curproc = myproc();
+  struct futexq *q;
+  struct waiter w, **pp;
+  int *ip;
+
+  lockvm(curproc);
+  if((ip = futexaddr(addr, &w.key)) == 0){
+    unlockvm(curproc);
+    return -1;
+  }
+  w.woken = 0;
+  q = hashq(&w.key);
+  acquire(&q->lock);
+  // Compare while the page cannot go away; a FUTEX_WAKE
+  // after the store that changed it needs q->lock.
+  if(*ip != val){
+    release(&q->lock);
+    unlockvm(curproc);
+    return -1;
+  }
+  w.next = q->head;
+  q->head = &w;
+  unlockvm(curproc);
+  while(!w.woken && !curproc->killed)
+    sleep(&w, &q->lock);
+  if(!w.woken){
+    for(pp = &q->head; *pp != &w; pp = &(*pp)->next)
+      ;
+    *pp = w.next;
+  }
+  release(&q->lock);
+  return w.woken ? 0 : -1;
+}
+
+static int
+futexwake(uint addr, int n)
+{
+  struct proc *curproc = myproc();
+  struct futexq *q;
+  struct waiter *w, **pp;
+  struct futexkey key;
+  int *ip, woken;
+
+  lockvm(curproc);
+  ip = futexaddr(addr, &key);
+  unlockvm(curproc);
+  if(ip == 0)
+    return -1;
+  q = hashq(&key);
+  woken = 0;
+  acquire(&q->lock);
+  for(pp = &q->head; (w = *pp) != 0 && woken < n; ){
+    if(!samekey(&w->key, &key)){
+      pp = &w->next;
+      continue;
+    }
+    *pp = w->next;
+    w->woken = 1;
+    wakeup(w);
+    woken++;
+  }
+  release(&q->lock);
+  return woken;
+}
+
+// Is a thread of group leader mm waiting on an int in the
+// page at user address va?  The swapper leaves such a page
+// in memory: the thread that wakes the waiter is about to
+// store to it.
+int
+futexwaiting(struct proc *mm, uint va)
+{
+  struct futexq *q;
+  struct waiter *w;
+
+  va = PGROUNDDOWN(va);
+  for(q = futexq; q < &futexq[NFUTEXQ]; q++){
+    acquire(&q->lock);
+    for(w = q->head; w; w = w->next){
+      if(w->key.mm == mm && PGROUNDDOWN(w->key.addr) == va){
+        release(&q->lock);
+        return 1;
+      }
+    }
+    release(&q->lock);
+  }
+  return 0;
+}
+
+// FUTEX_WAIT returns 0 when woken, -1 if *addr != val or the
+// caller was killed.  FUTEX_WAKE returns the number woken.
+int
+futex(uint addr, int op, int val)
+{
+  switch(op){
+  case FUTEX_WAIT:
+    return futexwait(addr, val);
+  case FUTEX_WAKE:
+    return futexwake(addr, val);
+  }
+  return -1;
+}
@@ -1,4 +1,10 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code.
+//
+// If the IDE controller on the PCI bus can act as bus master,
+// the disk moves the data itself by DMA, to or from the
+// physical region the PRD table describes, and interrupts when
+// done.  Otherwise, or after a DMA error, the driver falls back
+// to PIO, copying the data through port 0x1f0.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +18,8 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
+#include "elevator.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,16 +31,54 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+#define IDE_CMD_SETMUL 0xc6
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// Most sectors one command moves.  Adjacent queued requests
+// are merged into one command up to this size.
+#define IDEMULT       16    // PIO: sectors per READ/WRITE MULTIPLE interrupt
+#define IDEDMAMAX     256   // DMA: sector count register limit
+
+// Bus-master registers, at offsets from idebm.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4   // physical address of PRD table
+
+#define BM_START      0x01  // BM_CMD: start transfer
+#define BM_READ       0x08  // BM_CMD: disk to memory
+#define BM_ERR        0x02  // BM_STATUS: error; write 1 to clear
+#define BM_INTR       0x04  // BM_STATUS: interrupt; write 1 to clear
+
+#define PCI_IDE_BM    0x80  // PCI_CLASS prog if: bus master capable
+
+// A physical region descriptor: one contiguous piece of
+// memory taking part in a DMA transfer.  A PRD must not
+// cross a 64KB boundary.
+struct prd {
+  uint addr;
+  ushort n;        // bytes
+  ushort flags;
+};
+#define PRD_EOT 0x8000  // last PRD in the table
+
+// idecur points to the bufs now being read/written to the disk:
+// a run of consecutive blocks, linked by qnext.
+// idequeue holds the bufs waiting to be processed, in the
+// order the I/O scheduler picks (see elevator.c).
+// You must hold idelock while manipulating the queue.
 
 static struct spinlock idelock;
-static struct buf *idequeue;
+static struct buf *idecur;
+static struct elevq idequeue;
 
 static int havedisk1;
+static int virtiodisk1;   // disk 1 is a virtio disk (see virtio.c)
+static ushort idebm;      // bus-master I/O base; 0 if using PIO
+static struct prd *prdt;  // page holding the PRD table
 static void idestart(struct buf*);
+static void idedmainit(void);
+static void idesetmult(int);
 
 // Wait for IDE disk to become ready.
 static int
@@ -53,6 +99,7 @@ ideinit(void)
   int i;
 
   initlock(&idelock, "ide");
+  elvinit(&idequeue, &IOSCHED);
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
 
@@ -65,35 +112,111 @@ ideinit(void)
     }
   }
 
+  idesetmult(0);
+  if(havedisk1)
+    idesetmult(1);
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  if(!havedisk1 && virtioinit() == 0)
+    virtiodisk1 = 1;
+
+  idedmainit();
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Have disk dev transfer IDEMULT sectors per interrupt in
+// READ/WRITE MULTIPLE commands, rather than one.
+static void
+idesetmult(int dev)
+{
+  idewait(0);
+  outb(0x3f6, 2);  // no interrupt
+  outb(0x1f6, 0xe0 | (dev<<4));
+  outb(0x1f2, IDEMULT);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  idewait(0);
+}
+
+// Return the most bufs one request can hold.
+static int
+idemaxbufs(void)
+{
+  return (idebm ? IDEDMAMAX : IDEMULT) / (BSIZE/SECTOR_SIZE);
+}
+
+// Use DMA if the PCI IDE controller is a bus master.
+static void
+idedmainit(void)
+{
+  int tag;
+  uint bar;
+
+  if((tag = pcifind(PCI_STORAGE, PCI_IDE)) < 0)
+    return;
+  if(!(pciread(tag, PCI_CLASS) & (PCI_IDE_BM<<8)))
+    return;
+  bar = pciread(tag, PCI_BAR4);
+  if(!(bar & 1) || (bar & ~3) == 0)  // not an I/O space BAR
+    return;
+  if((prdt = (struct prd*)kalloc()) == 0)
+    return;
+  pciwrite(tag, PCI_CMD, pciread(tag, PCI_CMD) | PCI_CMD_IO | PCI_CMD_MASTER);
+  idebm = bar & ~3;
+}
+
+// Start the request for b and the bufs chained to it, which
+// hold consecutive blocks.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *p;
+  int i, n;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
+  n = 0;
+  for(p = b; p; p = p->qnext){
+    if(p->blockno >= FSSIZE + NSWAP*PGBLOCKS)
+      panic("incorrect blockno");
+    n++;
+  }
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  int nsector = n * sector_per_block;
+  int read_cmd = (nsector == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
+  int write_cmd = (nsector == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+
+  if (n > idemaxbufs()) panic("idestart");
 
-  if (sector_per_block > 7) panic("idestart");
+  if(idebm){
+    // Each buf's data is contiguous in physical memory, and
+    // lies within a page, so one PRD describes it.
+    i = 0;
+    for(p = b; p; p = p->qnext, i++){
+      prdt[i].addr = V2P(p->data);
+      prdt[i].n = BSIZE;
+      prdt[i].flags = p->qnext ? 0 : PRD_EOT;
+    }
+    outl(idebm + BM_PRDT, V2P(prdt));
+    outb(idebm + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_READ);
+    outb(idebm + BM_STATUS, BM_ERR|BM_INTR);
+  }
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, nsector & 0xff);  // number of sectors; 0 means 256
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
+  if(idebm){
+    outb(0x1f7, (b->flags & B_DIRTY) ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(idebm + BM_CMD, inb(idebm + BM_CMD) | BM_START);
+  } else if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    for(p = b; p; p = p->qnext)
+      outsl(0x1f0, p->data, BSIZE/4);
   } else {
     outb(0x1f7, read_cmd);
   }
@@ -103,66 +226,109 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next;
+  uchar s;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if((b = idecur) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idebm){
+    outb(idebm + BM_CMD, 0);
+    s = inb(idebm + BM_STATUS);
+    outb(idebm + BM_STATUS, BM_ERR|BM_INTR);
+    if((s & BM_ERR) || idewait(1) < 0){
+      // Give up on DMA, and redo the request with PIO,
+      // which may take it in smaller pieces.
+      cprintf("ide: DMA error, using PIO\n");
+      idebm = 0;
+      for(; b; b = next){
+        next = b->qnext;
+        elvadd(&idequeue, b);
+      }
+      idecur = elvnext(&idequeue, idemaxbufs());
+      idestart(idecur);
+      release(&idelock);
+      return;
+    }
+  } else if(!(b->flags & B_DIRTY) && idewait(1) >= 0){
+    // Read data if needed.
+    for(next = b; next; next = next->qnext)
+      insl(0x1f0, next->data, BSIZE/4);
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for these bufs.
+  for(; b; b = next){
+    next = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->iodone)
+      b->iodone(b);
+  }
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  // Start disk on next bufs in queue.
+  if((idecur = elvnext(&idequeue, idemaxbufs())) != 0)
+    idestart(idecur);
 
   release(&idelock);
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Start syncing buf with disk, without waiting: see iderw.
+// If b->iodone is set, ideintr() calls it when the request
+// finishes.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
-  struct buf **pp;
-
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
     panic("iderw: nothing to do");
+  if(b->dev != 0 && virtiodisk1){
+    virtiosubmit(b);
+    return;
+  }
   if(b->dev != 0 && !havedisk1)
     panic("iderw: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  elvadd(&idequeue, b);  //DOC:insert-queue
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(idecur == 0){
+    idecur = elvnext(&idequeue, idemaxbufs());
+    idestart(idecur);
+  }
+
+  release(&idelock);
+}
 
-  // Wait for request to finish.
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  idecomplete(b);
+}
+
+// Wait for the request idesubmit() started for b to finish.
+void
+idecomplete(struct buf *b)
+{
+  if(b->dev != 0 && virtiodisk1){
+    virtiocomplete(b);
+    return;
+  }
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
-
-
   release(&idelock);
 }
@@ -1,6 +1,17 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// The frame table describes every physical page: how many
+// holders it has, and for user pages, the PTEs that map it
+// (its reverse map), so that the swapper can find and change
+// all of them.  Mapped user pages are kept on an LRU list,
+// least recently visited by the swapper's clock first.
+//
+// Idle CPUs zero free pages ahead of time (kzerofill), so that
+// kzalloc() can usually hand out a zeroed page without the cost
+// of zeroing it.  The zero page is a page of zeros that user
+// memory maps, read-only, until it is first written.
 
 #include "types.h"
 #include "defs.h"
@@ -8,11 +19,14 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "frame.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
 
+#define NZEROPOOL 64  // pre-zeroed free pages kzerofill() keeps
+
 struct run {
   struct run *next;
 };
@@ -21,8 +35,18 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  struct run *zerolist;       // free pages zeroed but for the link
+  int nzero;                  // pages on zerolist
+  int nfree;                  // pages on freelist or zerolist
+  char *zeropage;
+  struct frame frame[PHYSTOP/PGSIZE];
+  struct frame lru;           // head of the LRU list
+  int nlru;                   // frames on the LRU list
+  struct frame rmapq;         // head of the list of rmap pages with free entries
 } kmem;
 
+#define FRAME(v) (&kmem.frame[V2P(v)/PGSIZE])
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -33,6 +57,8 @@ kinit1(void *vstart, void *vend)
 {
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
+  kmem.lru.next = kmem.lru.prev = &kmem.lru;
+  kmem.rmapq.next = kmem.rmapq.prev = &kmem.rmapq;
   freerange(vstart, vend);
 }
 
@@ -41,6 +67,9 @@ kinit2(void *vstart, void *vend)
 {
   freerange(vstart, vend);
   kmem.use_lock = 1;
+  if((kmem.zeropage = kzalloc()) == 0)
+    panic("kinit2");
+  FRAME(kmem.zeropage)->flags |= F_ZERO;
 }
 
 void
@@ -63,6 +92,24 @@ kfree(char *v)
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
+  if(FRAME(v)->flags & F_ZERO)
+    return;
+
+  // A page shared copy-on-write is only freed
+  // when the last page table mapping it lets go.
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(FRAME(v)->ref > 1){
+    FRAME(v)->ref--;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return;
+  }
+  if(FRAME(v)->rmap)
+    panic("kfree: mapped");
+  FRAME(v)->ref = 0;
+  if(kmem.use_lock)
+    release(&kmem.lock);
 
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
@@ -72,6 +119,7 @@ kfree(char *v)
   r = (struct run*)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   if(kmem.use_lock)
     release(&kmem.lock);
 }
@@ -89,8 +137,309 @@ kalloc(void)
   r = kmem.freelist;
   if(r)
     kmem.freelist = r->next;
+  else if((r = kmem.zerolist) != 0){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+  }
+  if(r){
+    FRAME(r)->ref = 1;
+    kmem.nfree--;
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return (char*)r;
+}
+
+// Allocate a zeroed page, from the pool of pages
+// zeroed in advance if it has one.
+// Returns 0 if the memory cannot be allocated.
+char*
+kzalloc(void)
+{
+  struct run *r;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if((r = kmem.zerolist) != 0){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+    kmem.nfree--;
+    FRAME(r)->ref = 1;
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
+  if(r){
+    r->next = 0;
+    return (char*)r;
+  }
+  if((r = (struct run*)kalloc()) != 0)
+    memset(r, 0, PGSIZE);
   return (char*)r;
 }
 
+// Zero a free page for kzalloc(), unless the pool
+// is full.  Called by idle CPUs.
+void
+kzerofill(void)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  if(kmem.nzero >= NZEROPOOL || (r = kmem.freelist) == 0){
+    release(&kmem.lock);
+    return;
+  }
+  kmem.freelist = r->next;
+  release(&kmem.lock);
+
+  memset(r, 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zerolist;
+  kmem.zerolist = r;
+  kmem.nzero++;
+  release(&kmem.lock);
+}
+
+// Return the number of free pages.
+int
+kfreecount(void)
+{
+  return kmem.nfree;
+}
+
+// Return the zero page.  It is never freed, and its
+// holders and mappings are not counted.
+char*
+kzeropage(void)
+{
+  return kmem.zeropage;
+}
+
+// Record one more holder of the page at v, such as
+// a page table sharing it copy-on-write.
+void
+kincref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kincref");
+  if(FRAME(v)->flags & F_ZERO)
+    return;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(FRAME(v)->ref == 0xff)
+    panic("kincref: overflow");
+  FRAME(v)->ref++;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Return the number of holders of the page at v.
+int
+krefcount(char *v)
+{
+  int n;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  n = FRAME(v)->ref;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return n;
+}
+
+
+// Return a free rmap entry, carving a free page into
+// entries if there are none.  Caller holds kmem.lock.
+static struct rmap*
+rmapalloc(void)
+{
+  struct run *r;
+  struct frame *f;
+  struct rmap *m;
+  int i;
+
+  if((f = kmem.rmapq.next) == &kmem.rmapq){
+    if((r = kmem.freelist) != 0)
+      kmem.freelist = r->next;
+    else if((r = kmem.zerolist) != 0){
+      kmem.zerolist = r->next;
+      kmem.nzero--;
+    } else
+      return 0;
+    kmem.nfree--;
+    f = FRAME(r);
+    f->ref = 1;
+    f->flags |= F_RMAP;
+    f->nrmap = 0;
+    f->rmap = 0;
+    m = (struct rmap*)r;
+    for(i = 0; i < PGSIZE/sizeof(*m); i++){
+      m[i].next = f->rmap;
+      f->rmap = &m[i];
+    }
+    f->next = kmem.rmapq.next;
+    f->prev = &kmem.rmapq;
+    f->next->prev = f;
+    kmem.rmapq.next = f;
+  }
+  m = f->rmap;
+  f->rmap = m->next;
+  f->nrmap++;
+  if(f->rmap == 0){
+    // Full.
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+  }
+  return m;
+}
+
+// Free rmap entry m.  A page of entries none of which is in
+// use goes back on the free list, unless it is the only page
+// with free entries.  Caller holds kmem.lock.
+static void
+rmapfree(struct rmap *m)
+{
+  struct frame *f;
+  struct run *r;
+
+  f = FRAME(m);
+  if(f->rmap == 0){
+    f->next = kmem.rmapq.next;
+    f->prev = &kmem.rmapq;
+    f->next->prev = f;
+    kmem.rmapq.next = f;
+  }
+  m->next = f->rmap;
+  f->rmap = m;
+  if(--f->nrmap > 0 || (f->next == &kmem.rmapq && f->prev == &kmem.rmapq))
+    return;
+  f->prev->next = f->next;
+  f->next->prev = f->prev;
+  f->rmap = 0;
+  f->flags &= ~F_RMAP;
+  f->ref = 0;
+  r = (struct run*)PGROUNDDOWN((uint)m);
+  r->next = kmem.freelist;
+  kmem.freelist = r;
+  kmem.nfree++;
+}
+
+// Record that the PTE for user address va in pgdir maps
+// the page at v.  A page gets onto the LRU list, at the
+// tail, with its first mapping.  Returns 0 on success,
+// -1 if out of memory.
+int
+rmapadd(char *v, pde_t *pgdir, uint va)
+{
+  struct frame *f;
+  struct rmap *m;
+
+  if(FRAME(v)->flags & F_ZERO)
+    return 0;
+  acquire(&kmem.lock);
+  if((m = rmapalloc()) == 0){
+    release(&kmem.lock);
+    return -1;
+  }
+  f = FRAME(v);
+  m->pgdir = pgdir;
+  m->va = va;
+  m->next = f->rmap;
+  f->rmap = m;
+  if(!(f->flags & F_LRU)){
+    f->flags |= F_LRU;
+    f->prev = kmem.lru.prev;
+    f->next = &kmem.lru;
+    f->prev->next = f;
+    kmem.lru.prev = f;
+    kmem.nlru++;
+  }
+  release(&kmem.lock);
+  return 0;
+}
+
+// The PTE for user address va in pgdir no longer maps
+// the page at v.
+void
+rmapremove(char *v, pde_t *pgdir, uint va)
+{
+  struct frame *f;
+  struct rmap **pp, *m;
+
+  if(FRAME(v)->flags & F_ZERO)
+    return;
+  acquire(&kmem.lock);
+  f = FRAME(v);
+  for(pp = &f->rmap; (m = *pp) != 0; pp = &m->next)
+    if(m->pgdir == pgdir && m->va == va)
+      break;
+  if(m == 0)
+    panic("rmapremove");
+  *pp = m->next;
+  rmapfree(m);
+  if(f->rmap == 0){
+    f->flags &= ~F_LRU;
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+    kmem.nlru--;
+  }
+  release(&kmem.lock);
+}
+
+// Copy up to max of the mappings of the page at v into
+// map.  Returns how many there are, or -1 if more than max.
+int
+rmapget(char *v, struct rmap *map, int max)
+{
+  struct rmap *m;
+  int n;
+
+  acquire(&kmem.lock);
+  n = 0;
+  for(m = FRAME(v)->rmap; m != 0; m = m->next){
+    if(n == max){
+      release(&kmem.lock);
+      return -1;
+    }
+    map[n++] = *m;
+  }
+  release(&kmem.lock);
+  return n;
+}
+
+// Advance the swapper's clock: move the page at the head
+// of the LRU list to the tail and return it, with a
+// reference the caller must drop with kfree().
+// Returns 0 if no user pages are mapped.
+char*
+lrunext(void)
+{
+  struct frame *f;
+
+  acquire(&kmem.lock);
+  f = kmem.lru.next;
+  if(f == &kmem.lru){
+    release(&kmem.lock);
+    return 0;
+  }
+  f->prev->next = f->next;
+  f->next->prev = f->prev;
+  f->prev = kmem.lru.prev;
+  f->next = &kmem.lru;
+  f->prev->next = f;
+  kmem.lru.prev = f;
+  if(f->ref == 0xff)
+    panic("lrunext: overflow");
+  f->ref++;
+  release(&kmem.lock);
+  return P2V((f - kmem.frame) * PGSIZE);
+}
+
+// Return the number of pages on the LRU list.
+int
+lrusize(void)
+{
+  return kmem.nlru;
+}
@@ -1,6 +1,7 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -27,7 +28,19 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+//
+// The log is double-buffered: a commit copies the blocks of the
+// transaction into memory of its own (log.snap), and the next
+// transaction starts at once, while the committed one is being
+// written to disk from the copies.  The cache keeps the blocks
+// pinned until the transaction that last changed them is
+// written, so the cache never shrinks below NBUF: room for the
+// blocks of two transactions and of one more operation.  A
+// transaction that finishes while the one before it is being
+// written commits when that is done, together with any system
+// calls that finish meanwhile (group commit).  The writes of
+// the log blocks, and of their home locations, are all in
+// flight at once.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,8 +55,12 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int writing;     // a committed transaction is being written.
   int dev;
-  struct logheader lh;
+  struct logheader lh;    // the transaction being built
+  struct logheader wlh;   // the transaction being written
+  char *snap[LOGSIZE];    // copies of wlh's blocks
+  struct buf io[LOGSIZE]; // for writing the copies, bypassing the cache
 };
 struct log log;
 
@@ -53,6 +70,9 @@ static void commit();
 void
 initlog(int dev)
 {
+  char *mem;
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
@@ -62,37 +82,64 @@ initlog(int dev)
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  mem = 0;
+  for (i = 0; i < LOGSIZE; i++) {
+    if (i*BSIZE % PGSIZE == 0 && (mem = kalloc()) == 0)
+      panic("initlog: out of memory");
+    log.snap[i] = mem + i*BSIZE % PGSIZE;
+    initsleeplock(&log.io[i].lock, "logio");
+  }
   recover_from_log();
 }
 
+// Write the copies of the blocks of the transaction being
+// written to the log if tolog is set, else to their home
+// locations.
+static void
+write_blocks(int tolog)
+{
+  struct buf *b;
+  int i;
+
+  for (i = 0; i < log.wlh.n; i++) {
+    b = &log.io[i];
+    acquiresleep(&b->lock);
+    b->dev = log.dev;
+    b->blockno = tolog ? log.start+i+1 : log.wlh.block[i];
+    b->data = (uchar*)log.snap[i];
+    bwritestart(b);
+  }
+  for (i = 0; i < log.wlh.n; i++) {
+    bwait(&log.io[i]);
+    releasesleep(&log.io[i].lock);
+  }
+}
+
 // Copy committed blocks from log to their home location
 static void
 install_trans(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  write_blocks(0);
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into the in-memory log header,
+// and the blocks of the log into their copies.
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.wlh.n = lh->n;
+  for (i = 0; i < log.wlh.n; i++) {
+    log.wlh.block[i] = lh->block[i];
   }
   brelse(buf);
+  for (i = 0; i < log.wlh.n; i++) {
+    buf = bread(log.dev, log.start+i+1);
+    memmove(log.snap[i], buf->data, BSIZE);
+    brelse(buf);
+  }
 }
 
 // Write in-memory log header to disk.
@@ -104,9 +151,9 @@ write_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.wlh.n;
+  for (i = 0; i < log.wlh.n; i++) {
+    hb->block[i] = log.wlh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -117,7 +164,7 @@ recover_from_log(void)
 {
   read_head();
   install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
+  log.wlh.n = 0;
   write_head(); // clear the log
 }
 
@@ -141,7 +188,9 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless the previous transaction is still being written:
+// then that commit will commit this transaction too.
 void
 end_op(void)
 {
@@ -151,7 +200,7 @@ end_op(void)
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.outstanding == 0 && !log.writing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -166,44 +215,93 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks of the transaction built so far, which no
+// system call can change now, and make it the transaction
+// being written.
+static void
+snapshot(void)
+{
+  struct buf *b;
+  int i;
+
+  for (i = 0; i < log.lh.n; i++) {
+    b = bread(log.dev, log.lh.block[i]); // cache block
+    memmove(log.snap[i], b->data, BSIZE);
+    brelse(b);
+    log.wlh.block[i] = log.lh.block[i];
+  }
+  log.wlh.n = log.lh.n;
+}
+
+// The blocks of the transaction being written are at home on
+// disk.  Unpin those the next transaction has not changed, so
+// that the cache can evict them.
 static void
-write_log(void)
+unpin(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *b;
+  int i, j;
+
+  for (i = 0; i < log.wlh.n; i++) {
+    b = bread(log.dev, log.wlh.block[i]);
+    acquire(&log.lock);
+    for (j = 0; j < log.lh.n; j++) {
+      if (log.lh.block[j] == b->blockno)
+        break;
+    }
+    if (j == log.lh.n)
+      b->flags &= ~B_DIRTY;
+    release(&log.lock);
+    brelse(b);
   }
 }
 
+// Commit the transaction built so far, and then the next one
+// if it finishes while this one is being written.
+// Caller has set log.committing.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+  while (1) {
+    if (log.lh.n > 0)
+      snapshot();
+    acquire(&log.lock);
+    log.committing = 0;
+    if (log.lh.n == 0) {
+      wakeup(&log);
+      release(&log.lock);
+      return;
+    }
+    log.lh.n = 0;
+    log.writing = 1;
+    wakeup(&log);  // the next transaction may start
+    release(&log.lock);
+
+    write_blocks(1); // Write the copies to the log
     write_head();    // Write header to disk -- the real commit
     install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
+    unpin();
+    log.wlh.n = 0;
     write_head();    // Erase the transaction from the log
+
+    acquire(&log.lock);
+    log.writing = 0;
+    if (log.outstanding > 0 || log.lh.n == 0) {
+      wakeup(&log);
+      release(&log.lock);
+      return;
+    }
+    log.committing = 1;
+    release(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -19,6 +19,7 @@ main(void)
 {
   kinit1(end, P2V(4*1024*1024)); // phys page allocator
   kvmalloc();      // kernel page table
+  pgeinit();       // global kernel mappings
   mpinit();        // detect other processors
   lapicinit();     // interrupt controller
   seginit();       // segment descriptors
@@ -30,6 +31,8 @@ main(void)
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
+  shminit();       // shared-memory segments
+  futexinit();     // futex wait queues
   ideinit();       // disk 
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
@@ -42,6 +45,7 @@ static void
 mpenter(void)
 {
   switchkvm();
+  pgeinit();
   seginit();
   lapicinit();
   mpmain();
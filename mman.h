@@ -0,0 +1,11 @@
+// mmap() protection and mapping flags.
+// Both the kernel and user programs use this header file.
+
+#define PROT_READ     0x1  // pages may be read
+#define PROT_WRITE    0x2  // pages may be written
+
+#define MAP_SHARED    0x1  // writes are seen by the file and by fork children
+#define MAP_PRIVATE   0x2  // writes stay in this process
+#define MAP_ANONYMOUS 0x4  // zero-filled memory, not backed by a file
+
+#define MAP_FAILED    ((void*)-1)
@@ -0,0 +1,275 @@
+// Memory-mapped regions: mmap() and munmap().
+//
+// Each process has a small table of regions (p->vma) whose
+// pages are filled in on first touch by pagefault() in vm.c.
+// exec() uses them for program segments; mmap() adds regions
+// backed by a file or by zero-filled memory, placed top-down
+// from MMAPTOP so that they stay clear of the sbrk() heap.
+//
+// MAP_PRIVATE pages start as a private copy of the file and
+// are shared copy-on-write with fork children like any other
+// page.  MAP_SHARED pages carry PTE_SHARED, so fork children
+// map the very same pages, and pages written through the
+// mapping are written back to the file by munmap() and exit().
+// Pages not touched before a fork come from a segment the
+// parent and child share (see vmashare).  Processes that map a
+// file MAP_SHARED separately get pages of their own, and see
+// each other's stores only through the file.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "mman.h"
+
+// Does [start, end) overlap any region of p?
+int
+vmaoverlap(struct proc *p, uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && start < v->end && v->start < end)
+      return 1;
+  return 0;
+}
+
+// Write the pages of shared file mapping v in [start, end)
+// that p has written to back to the file.  Only bytes that
+// already exist in the file are written; the mapping never
+// extends the file.
+static void
+writeback(struct proc *p, struct vma *v, uint start, uint end)
+{
+  // Write a few blocks at a time, as in filewrite().
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint a, off, n, i, m;
+  char *mem;
+
+  for(a = start; a < end; a += PGSIZE){
+    if(a - v->start >= v->filesz)
+      break;
+    if((mem = uvmdirty(p->pgdir, a)) == 0)
+      continue;
+    off = v->off + (a - v->start);
+    n = v->filesz - (a - v->start);
+    if(n > PGSIZE)
+      n = PGSIZE;
+    for(i = 0; i < n; i += m){
+      m = n - i;
+      if(m > max)
+        m = max;
+      begin_op();
+      ilock(v->ip);
+      if(off + i >= v->ip->size)
+        m = n - i;  // past end of file: done with this page
+      else {
+        if(off + i + m > v->ip->size)
+          m = v->ip->size - (off + i);
+        writei(v->ip, mem + i, off + i, m);
+      }
+      iunlock(v->ip);
+      end_op();
+    }
+  }
+}
+
+// Remove [start, end) from region v of p, which it must
+// overlap: write back shared file pages, free the pages,
+// and shrink, split or release the region.
+// Returns 0 on success, -1 if splitting v needs a free slot
+// and there is none.
+static int
+vmaunmap(struct proc *p, struct vma *v, uint start, uint end)
+{
+  struct vma *nv;
+  uint cut;
+
+  if(start < v->start)
+    start = v->start;
+  if(end > v->end)
+    end = v->end;
+
+  nv = 0;
+  if(start > v->start && end < v->end){
+    for(nv = p->vma; nv < &p->vma[NVMA]; nv++)
+      if(nv->end == 0)
+        break;
+    if(nv == &p->vma[NVMA])
+      return -1;
+  }
+
+  if(v->ip && (v->flags & MAP_SHARED))
+    writeback(p, v, start, end);
+  deallocuvm(p->pgdir, end, start);
+
+  if(nv){
+    // Punch a hole: nv becomes the part above it.
+    *nv = *v;
+    cut = end - v->start;
+    nv->start = end;
+    nv->off += cut;
+    nv->filesz = nv->filesz > cut ? nv->filesz - cut : 0;
+    if(nv->ip)
+      idup(nv->ip);
+    if(nv->shm)
+      shmdup(nv->shm);
+    v->end = start;
+  } else if(start > v->start){
+    v->end = start;
+  } else if(end < v->end){
+    cut = end - v->start;
+    v->start = end;
+    v->off += cut;
+    v->filesz = v->filesz > cut ? v->filesz - cut : 0;
+  } else {
+    if(v->ip){
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    if(v->shm)
+      shmclose(v->shm);
+    memset(v, 0, sizeof(*v));
+    return 0;
+  }
+  if(v->filesz > v->end - v->start)
+    v->filesz = v->end - v->start;
+  return 0;
+}
+
+// Map len bytes of f starting at offset off (or zero-filled
+// memory, if f is 0) into the current process.
+// Returns the address of the mapping, or -1.
+int
+mmap(uint len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *mm = myproc()->leader;
+  struct vma *v, *free;
+  uint start, end;
+
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+  len = PGROUNDUP(len);
+  if(len == 0 || len > MMAPTOP)
+    return -1;
+
+  free = 0;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->end == 0){
+      free = v;
+      break;
+    }
+  if(free == 0)
+    return -1;
+
+  // Take the highest free range below MMAPTOP.
+  end = MMAPTOP;
+  for(;;){
+    if(end < len || end - len < PGROUNDUP(mm->sz))
+      return -1;
+    start = end - len;
+    for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+      if(v->end != 0 && start < v->end && v->start < end)
+        break;
+    if(v == &mm->vma[NVMA])
+      break;
+    end = v->start;
+  }
+
+  free->start = start;
+  free->end = end;
+  free->ip = f ? idup(f->ip) : 0;
+  free->off = off;
+  free->filesz = f ? len : 0;
+  free->prot = prot & (PROT_READ|PROT_WRITE);
+  free->flags = flags & (MAP_SHARED|MAP_PRIVATE);
+  free->shm = 0;
+  return start;
+}
+
+// Unmap the pages in [addr, addr+len) of the current process.
+// The caller must hold the address space lock.
+// Returns 0 on success, -1 on error.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *mm = myproc()->leader;
+  struct vma *v;
+  uint end;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  if(end <= addr || end > KERNBASE)
+    return -1;
+  // Another thread's system call may be using the memory.
+  if(pinned(mm, addr, end))
+    return -1;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->end == 0 || end <= v->start || v->end <= addr)
+      continue;
+    if(vmaunmap(mm, v, addr, end) < 0)
+      return -1;
+  }
+  tlbflush(mm->pgdir, addr, end - addr);
+  return 0;
+}
+
+// Back each of p's MAP_SHARED regions with a segment, if none
+// does yet, before a fork: copyuvm() gives the child the pages
+// p has, and the segment lets the two fault in the rest from
+// the same pages.  The caller must hold p's address space lock.
+// Returns 0 on success, -1 if out of segments or memory.
+int
+vmashare(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && (v->flags & MAP_SHARED) && v->shm == 0)
+      if(shmanon(p, v) < 0)
+        return -1;
+  return 0;
+}
+
+// Give fork child np the same regions as p.
+void
+vmadup(struct proc *np, struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(np->vma[i].ip)
+      idup(np->vma[i].ip);
+    if(np->vma[i].shm)
+      shmdup(np->vma[i].shm);
+  }
+}
+
+// Unmap all of p's regions, writing back shared file pages.
+// Must not be called inside a transaction.
+void
+vmafree(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0)
+      vmaunmap(p, v, v->start, v->end);
+}
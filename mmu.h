@@ -10,6 +10,10 @@
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
+
+// CPUID leaf 1 feature flags in %edx
+#define CPUID_PGE       0x00002000      // Global pages supported
 
 // various segment selectors.
 #define SEG_KCODE 1  // kernel code
@@ -83,6 +87,7 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define PTSIZE          (PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -94,12 +99,23 @@ struct segdesc {
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
+#define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global: kept in the TLB across %cr3 loads
+#define PTE_COW         0x200   // Copy-on-write (software-defined)
+#define PTE_SHARED      0x400   // Shared with fork children (software-defined)
+#define PTE_SWAP        0x800   // Not present: PTE_ADDR>>12 is a swap slot (software-defined)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
 #define PTE_FLAGS(pte)  ((uint)(pte) &  0xFFF)
 
+// Page fault error code bits (pushed by the CPU as tf->err).
+#define FEC_PR          0x1     // Page fault caused by protection violation
+#define FEC_WR          0x2     // Page fault caused by a write
+#define FEC_U           0x4     // Page fault occured while in user mode
+
 #ifndef __ASSEMBLER__
 typedef uint pte_t;
 
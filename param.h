@@ -2,6 +2,11 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NVMA         16  // demand-paged memory regions per process
+#define NPIN          4  // user memory ranges a system call pins
+#define NARGFILE      4  // file descriptors a system call uses
+#define NSHM         64  // shared-memory segments per system
+#define SHMPAGES     64  // maximum pages in a shared-memory segment
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
@@ -9,6 +14,9 @@
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (2*LOGSIZE+MAXOPBLOCKS)  // minimum size of disk block cache
+#define BCACHEFRAC   8  // disk block cache grows to 1/BCACHEFRAC of memory
 #define FSSIZE       1000  // size of file system in blocks
+#define NSWAP        256  // pages of swap space after the file system
+#define IOSCHED      elvclook  // disk I/O scheduler: elvclook or elvfifo
 
@@ -0,0 +1,73 @@
+// PCI configuration space, through configuration mechanism #1:
+// write the address of a register to CONFIG_ADDR, then read or
+// write the register at CONFIG_DATA.
+//
+// A device function is named by a tag, the bus, device and
+// function number bits of the register address.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+#include "pci.h"
+
+#define CONFIG_ADDR 0xcf8
+#define CONFIG_DATA 0xcfc
+
+#define TAG(bus, dev, func) ((bus)<<16 | (dev)<<11 | (func)<<8)
+
+// Read the 32-bit register at offset off of device function tag.
+uint
+pciread(int tag, int off)
+{
+  outl(CONFIG_ADDR, 0x80000000 | tag | (off & 0xfc));
+  return inl(CONFIG_DATA);
+}
+
+void
+pciwrite(int tag, int off, uint v)
+{
+  outl(CONFIG_ADDR, 0x80000000 | tag | (off & 0xfc));
+  outl(CONFIG_DATA, v);
+}
+
+// Return the tag of the first device function whose register
+// at off, masked with mask, is val, or -1 if there is none.
+static int
+pciscan(int off, uint mask, uint val)
+{
+  int bus, dev, func, nfunc, tag;
+
+  for(bus = 0; bus < 256; bus++){
+    for(dev = 0; dev < 32; dev++){
+      if((pciread(TAG(bus, dev, 0), PCI_ID) & 0xffff) == 0xffff)
+        continue;
+      nfunc = 1;
+      if(pciread(TAG(bus, dev, 0), PCI_HEADER) & PCI_MULTIFUNC)
+        nfunc = 8;
+      for(func = 0; func < nfunc; func++){
+        tag = TAG(bus, dev, func);
+        if((pciread(tag, PCI_ID) & 0xffff) == 0xffff)
+          continue;
+        if((pciread(tag, off) & mask) == val)
+          return tag;
+      }
+    }
+  }
+  return -1;
+}
+
+// Return the tag of the first device function of the given
+// class and subclass, or -1 if there is none.
+int
+pcifind(int class, int subclass)
+{
+  return pciscan(PCI_CLASS, 0xffff0000, class<<24 | subclass<<16);
+}
+
+// Return the tag of the first device function with the given
+// vendor and device IDs, or -1 if there is none.
+int
+pcifindid(int vendor, int device)
+{
+  return pciscan(PCI_ID, 0xffffffff, device<<16 | vendor);
+}
@@ -0,0 +1,18 @@
+// PCI configuration space registers and codes.
+
+#define PCI_ID        0x00  // device ID << 16 | vendor ID
+#define PCI_CMD       0x04  // status << 16 | command
+#define PCI_CLASS     0x08  // class << 24 | subclass << 16 | prog if << 8 | rev
+#define PCI_HEADER    0x0c  // header type is bits 16-23
+#define PCI_BAR0      0x10  // base address registers 0-5
+#define PCI_BAR4      0x20
+#define PCI_INTR      0x3c  // interrupt line is bits 0-7
+
+#define PCI_CMD_IO     0x1  // respond to I/O space accesses
+#define PCI_CMD_MEM    0x2  // respond to memory space accesses
+#define PCI_CMD_MASTER 0x4  // may act as bus master (DMA)
+
+#define PCI_MULTIFUNC 0x800000  // PCI_HEADER: device has functions 1-7
+
+#define PCI_STORAGE   0x01  // mass storage class
+#define PCI_IDE       0x01  // IDE controller subclass
@@ -6,6 +6,7 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "pstat.h"
 //#include "rbt.h"
 
 struct {
@@ -569,6 +570,13 @@ found:
   p->right = 0;
   p->parentP = 0;
 
+  memset(p->vma, 0, sizeof(p->vma));
+  p->leader = p;
+  p->vmlocked = 0;
+  p->ustack = 0;
+  p->npin = 0;
+  p->nargfile = 0;
+
   return p;
 }
 
@@ -613,24 +621,133 @@ userinit(void)
   insertProcess(runnableTasks, p);
 }
 
+// Lock the address space of p: the sz, vma and page table
+// that all threads of p's group share.  May sleep.
+void
+lockvm(struct proc *p)
+{
+  p = p->leader;
+  acquire(&ptable.lock);
+  while(p->vmlocked)
+    sleep(&p->vmlocked, &ptable.lock);
+  p->vmlocked = 1;
+  release(&ptable.lock);
+}
+
+void
+unlockvm(struct proc *p)
+{
+  p = p->leader;
+  acquire(&ptable.lock);
+  p->vmlocked = 0;
+  wakeup1(&p->vmlocked);
+  release(&ptable.lock);
+}
+
+// For the swapper: lock the address space whose page table
+// is pgdir, unless its lock is held or it is not a live
+// process's.  Returns the group leader, or 0.
+struct proc*
+lockpgdir(pde_t *pgdir)
+{
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->leader != p || p->pgdir != pgdir)
+      continue;
+    if(p->vmlocked ||
+       (p->state != SLEEPING && p->state != RUNNABLE && p->state != RUNNING))
+      break;
+    p->vmlocked = 1;
+    release(&ptable.lock);
+    return p;
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
+// Pin user memory [start, end), which the current system call
+// is about to use, until the call returns.  Until then other
+// threads cannot unmap it, the swapper leaves it alone, and
+// fork() does not make it copy-on-write, so the kernel can use
+// it, even holding a spinlock, without taking a page fault.
+// The caller holds the address space lock, has checked the
+// range and faulted it in.  When the slots run out, the last
+// one grows to cover the range as well.
+void
+pinuvm(uint start, uint end)
+{
+  struct proc *curproc = myproc();
+  struct pin *pin;
+
+  if(start >= end)
+    return;
+  acquire(&ptable.lock);
+  if(curproc->npin < NPIN){
+    pin = &curproc->pin[curproc->npin++];
+    pin->start = start;
+    pin->end = end;
+  } else {
+    pin = &curproc->pin[NPIN-1];
+    if(start < pin->start)
+      pin->start = start;
+    if(end > pin->end)
+      pin->end = end;
+  }
+  release(&ptable.lock);
+}
+
+// Does a system call of some thread in the group of leader p
+// use part of user memory [start, end)?
+int
+pinned(struct proc *p, uint start, uint end)
+{
+  struct proc *q;
+  int i;
+
+  acquire(&ptable.lock);
+  for(q = ptable.proc; q < &ptable.proc[NPROC]; q++){
+    if(q->leader != p || q->state == UNUSED)
+      continue;
+    for(i = 0; i < q->npin; i++){
+      if(start < q->pin[i].end && q->pin[i].start < end){
+        release(&ptable.lock);
+        return 1;
+      }
+    }
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
 // Grow current process's memory by n bytes.
+// Growing only reserves the address range; pagefault()
+// allocates each page the first time it is touched.
+// Caller must hold the address space lock.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
   uint sz;
   struct proc *curproc = myproc();
+  struct proc *mm = curproc->leader;
 
-  sz = curproc->sz;
+  sz = mm->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(sz + n < sz || sz + n >= KERNBASE)
+      return -1;
+    if(vmaoverlap(mm, PGROUNDUP(sz), sz + n))
       return -1;
+    sz += n;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    // Another thread's system call may be using the memory.
+    if(pinned(mm, sz + n, sz))
+      return -1;
+    if((sz = deallocuvm(mm->pgdir, sz, sz + n)) == 0)
       return -1;
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
+  mm->sz = sz;
   return 0;
 }
 
@@ -640,9 +757,10 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *curproc = myproc();
+  struct proc *mm = curproc->leader;
 
   // Allocate process.
   if((np = allocproc()) == 0){
@@ -650,23 +768,27 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  lockvm(curproc);
+  if(vmashare(mm) < 0 || (np->pgdir = copyuvm(mm)) == 0){
+    unlockvm(curproc);
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
-  np->sz = curproc->sz;
+  // Parent's pages are now copy-on-write.
+  tlbflush(mm->pgdir, 0, KERNBASE);
+  np->sz = mm->sz;
+  vmadup(np, mm);
+  unlockvm(curproc);
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
+  fdcopy(np);
+  np->cwd = idupcwd();
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -684,6 +806,182 @@ fork(void)
   return pid;
 }
 
+// Create a thread that shares the address space of the current
+// process and runs fcn(arg) on the user stack whose top is
+// stack.  The thread starts with the same open files and
+// current directory as its creator.  If fcn returns, the
+// thread faults; it should call exit() instead.
+// Returns the new thread's pid, or -1 on error.
+int
+clone(uint fcn, uint arg, uint stack)
+{
+  int pid;
+  struct proc *np;
+  struct proc *curproc = myproc();
+  uint sp, ustack[2];
+
+  sp = stack - sizeof(ustack);
+  if(stack % 4 != 0 || sp > stack)
+    return -1;
+  ustack[0] = 0xffffffff;  // fake return PC
+  ustack[1] = arg;
+  // Locked, so the page cannot be swapped out in between.
+  lockvm(curproc);
+  if(faultuvm(curproc->leader, sp, sizeof(ustack), 1) < 0 ||
+     copyout(curproc->pgdir, sp, ustack, sizeof(ustack)) < 0){
+    unlockvm(curproc);
+    return -1;
+  }
+  unlockvm(curproc);
+
+  if((np = allocproc()) == 0)
+    return -1;
+  np->pgdir = curproc->pgdir;
+  np->leader = curproc->leader;
+  np->parent = curproc->leader;
+  np->ustack = stack;
+  *np->tf = *curproc->tf;
+  np->tf->eip = fcn;
+  np->tf->esp = sp;
+
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+
+  np->state = RUNNABLE;
+
+  release(&ptable.lock);
+
+  //cfs
+  insertProcess(runnableTasks, np);
+
+  return pid;
+}
+
+// Free the slot of thread p, which has exited.
+// The ptable lock must be held.
+static void
+freethread(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  p->pgdir = 0;
+  p->leader = p;
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->state = UNUSED;
+}
+
+// Wait for another thread of the current process to exit,
+// store the stack it was given to clone() at *stack, and
+// return its pid.  Return -1 if there are no other threads.
+int
+join(uint stack)
+{
+  struct proc *p;
+  struct proc *curproc = myproc();
+  struct proc *mm = curproc->leader;
+  int havethreads, pid, r;
+  uint ustack;
+
+  // Make *stack writable now: once a thread is reaped, its
+  // pid must not be lost to a bad pointer.  sys_join() has
+  // pinned it, so it stays writable.
+  lockvm(curproc);
+  r = faultuvm(mm, stack, sizeof(ustack), 1);
+  unlockvm(curproc);
+  if(r < 0)
+    return -1;
+
+  acquire(&ptable.lock);
+  for(;;){
+    havethreads = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p->state == UNUSED || p->leader != mm || p == mm || p == curproc)
+        continue;
+      havethreads = 1;
+      if(p->state == ZOMBIE){
+        pid = p->pid;
+        ustack = p->ustack;
+        freethread(p);
+        release(&ptable.lock);
+        // Locked: copyout() may copy a copy-on-write page.
+        lockvm(curproc);
+        if(copyout(curproc->pgdir, stack, &ustack, sizeof(ustack)) < 0)
+          pid = -1;
+        unlockvm(curproc);
+        return pid;
+      }
+    }
+
+    if(!havethreads || curproc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+
+    // Exiting threads wake their leader.
+    sleep(mm, &ptable.lock);
+  }
+}
+
+// Return the number of threads other than p itself
+// that share p's address space and have not exited.
+int
+livethreads(struct proc *p)
+{
+  struct proc *q;
+  int n;
+
+  n = 0;
+  acquire(&ptable.lock);
+  for(q = ptable.proc; q < &ptable.proc[NPROC]; q++)
+    if(q != p && q->leader == p->leader &&
+       q->state != UNUSED && q->state != ZOMBIE)
+      n++;
+  release(&ptable.lock);
+  return n;
+}
+
+// Kill the threads of group leader p, wait for them
+// to exit, and free them.
+static void
+reapthreads(struct proc *p)
+{
+  struct proc *q;
+  int n;
+
+  acquire(&ptable.lock);
+  for(;;){
+    n = 0;
+    for(q = ptable.proc; q < &ptable.proc[NPROC]; q++){
+      if(q == p || q->leader != p || q->state == UNUSED)
+        continue;
+      if(q->state == ZOMBIE){
+        freethread(q);
+        continue;
+      }
+      n++;
+      q->killed = 1;
+      if(q->state == SLEEPING){
+        q->state = RUNNABLE;
+
+        q->virtualRuntime = q->virtualRuntime + q->currentRuntime;
+        q->currentRuntime = 0;
+
+        insertProcess(runnableTasks, q);
+      }
+    }
+    if(n == 0)
+      break;
+    sleep(p, &ptable.lock);
+  }
+  release(&ptable.lock);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -697,24 +995,40 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
+  // A group leader takes its threads with it.
+  if(curproc->leader == curproc)
+    reapthreads(curproc);
+
+  // Threads leave the address space, open files and current
+  // directory to their leader.  The address space lock is never
+  // released, which keeps the swapper away until wait() has
+  // freed the page table.
+  if(curproc->leader == curproc){
+    // Close all open files.
+    for(fd = 0; fd < NOFILE; fd++){
+      if(curproc->ofile[fd]){
+        fileclose(curproc->ofile[fd]);
+        curproc->ofile[fd] = 0;
+      }
     }
-  }
 
-  begin_op();
-  iput(curproc->cwd);
-  end_op();
-  curproc->cwd = 0;
+    lockvm(curproc);
+    vmafree(curproc);
+
+    begin_op();
+    iput(curproc->cwd);
+    end_op();
+    curproc->cwd = 0;
+  }
 
   acquire(&ptable.lock);
 
   // Parent might be sleeping in wait().
   wakeup1(curproc->parent);
 
+  // pstat() might be waiting for the address space lock.
+  wakeup1(&curproc->vmlocked);
+
   // Pass abandoned children to init.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == curproc){
@@ -744,7 +1058,7 @@ wait(void)
     // Scan through table looking for exited children.
     havekids = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
+      if(p->parent != curproc || p->leader != p)  // threads are join()ed
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
@@ -813,6 +1127,7 @@ scheduler(void)
 
         swtch(&(c->scheduler), p->context);
         switchkvm();
+        c->pgdir = 0;
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
@@ -825,6 +1140,9 @@ scheduler(void)
     
     release(&ptable.lock);
 
+    // Nothing to run: spend the idle time zeroing a free page.
+    kzerofill();
+
     // for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     //   if(p->state != RUNNABLE)
     //     continue;
@@ -944,6 +1262,7 @@ forkret(void)
     first = 0;
     iinit(ROOTDEV);
     initlog(ROOTDEV);
+    swapinit(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -1050,6 +1369,62 @@ kill(int pid)
   return -1;
 }
 
+static char *states[] = {
+[UNUSED]    "unused",
+[EMBRYO]    "embryo",
+[SLEEPING]  "sleep ",
+[RUNNABLE]  "runble",
+[RUNNING]   "run   ",
+[ZOMBIE]    "zombie"
+};
+
+// Report the memory use of up to n processes (threads count
+// toward their group leader) at ps, which the caller has
+// faulted in for writing.  Returns the number reported.
+int
+pstat(struct pstat *ps, int n)
+{
+  struct proc *p, *q;
+  struct pstat st;
+  int i, pid;
+
+  i = 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC] && i < n; p++){
+    acquire(&ptable.lock);
+    if(p->state == UNUSED || p->state == EMBRYO || p->leader != p){
+      release(&ptable.lock);
+      continue;
+    }
+    memset(&st, 0, sizeof(st));
+    pid = p->pid;
+    st.pid = pid;
+    st.ppid = p->parent ? p->parent->pid : 0;
+    safestrcpy(st.state, states[p->state], sizeof(st.state));
+    safestrcpy(st.name, p->name, sizeof(st.name));
+    st.sz = p->sz;
+    for(q = ptable.proc; q < &ptable.proc[NPROC]; q++)
+      if(q->leader == p && q->kstack)
+        st.kstack += KSTACKSIZE/PGSIZE;
+    // Lock the address space to walk its page table.  An exiting
+    // process keeps its lock, and wakes us as it becomes a zombie.
+    while(p->vmlocked && p->pid == pid && p->state != ZOMBIE)
+      sleep(&p->vmlocked, &ptable.lock);
+    if(p->pid != pid){
+      release(&ptable.lock);
+      continue;
+    }
+    if(p->state != ZOMBIE){
+      p->vmlocked = 1;
+      release(&ptable.lock);
+      uvmstat(p->pgdir, &st);
+      unlockvm(p);
+    } else
+      release(&ptable.lock);
+    ps[i++] = st;
+  }
+  return i;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -1057,14 +1432,6 @@ kill(int pid)
 void
 procdump(void)
 {
-  static char *states[] = {
-  [UNUSED]    "unused",
-  [EMBRYO]    "embryo",
-  [SLEEPING]  "sleep ",
-  [RUNNABLE]  "runble",
-  [RUNNING]   "run   ",
-  [ZOMBIE]    "zombie"
-  };
   int i;
   struct proc *p;
   char *state;
@@ -8,6 +8,7 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  pde_t *pgdir;                // User page table loaded in %cr3, or 0
 };
 
 extern struct cpu cpus[NCPU];
@@ -34,12 +35,41 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of a process's address space whose pages are
+// filled in on first touch by pagefault() in vm.c.
+// A slot is unused when end is 0.
+struct vma {
+  uint start;                  // First address (page-aligned)
+  uint end;                    // One past the last address
+  struct inode *ip;            // File supplying the contents, or 0
+  uint off;                    // Offset in ip of the byte at start
+  uint filesz;                 // Bytes read from ip; the rest are zero
+  int prot;                    // PROT_READ, PROT_WRITE (see mman.h)
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct shm *shm;             // Shared-memory segment supplying the pages, or 0
+};
+
 enum Color { RED, BLACK };
 
 // Per-process state
+struct pin {
+  uint start;
+  uint end;
+};
+
+// The threads clone() creates share the address space of their
+// group leader: they use its sz and vma, and its pgdir.  They
+// also use its ofile and cwd.
 struct proc {
   uint sz;                     // Size of process memory (bytes)
   pde_t* pgdir;                // Page table
+  struct proc *leader;         // Owner of the address space (self unless a thread)
+  int vmlocked;                // Address space locked (see lockvm)
+  uint ustack;                 // Stack passed to clone(), returned by join()
+  struct pin pin[NPIN];        // User memory the current system call uses (see pinuvm)
+  int npin;
+  struct file *argfile[NARGFILE]; // Files of the current system call (see fdget)
+  int nargfile;
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
@@ -50,6 +80,7 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-paged regions (e.g. ELF segments)
   char name[16];               // Process name (debugging)
   int virtualtime;     
 
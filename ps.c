@@ -0,0 +1,30 @@
+// List processes and the memory they use.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "pstat.h"
+
+struct pstat ps[NPROC];
+
+int
+main(void)
+{
+  int i, n;
+  struct pstat *p;
+
+  if((n = pstat(ps, NPROC)) < 0){
+    printf(2, "ps: pstat failed\n");
+    exit();
+  }
+  // Sizes in Kbytes.
+  printf(1, "PID\tPPID\tSTATE\tSZ\tRSS\tSHARED\tSWAP\tPGTAB\tKSTACK\tNAME\n");
+  for(i = 0; i < n; i++){
+    p = &ps[i];
+    printf(1, "%d\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%s\n",
+           p->pid, p->ppid, p->state, p->sz/1024, p->rss*4, p->shared*4,
+           p->swap*4, p->pgtab*4, p->kstack*4, p->name);
+  }
+  exit();
+}
@@ -0,0 +1,14 @@
+// Memory use of a process, reported by pstat().
+// Page counts are in 4096-byte pages.
+struct pstat {
+  int pid;
+  int ppid;
+  char state[8];
+  char name[16];
+  uint sz;       // Size of the address space (bytes)
+  uint rss;      // User pages resident in memory
+  uint shared;   // Resident pages also held by other processes or shm
+  uint swap;     // User pages swapped out
+  uint pgtab;    // Page-table pages, including the page directory
+  uint kstack;   // Kernel stack pages, one per thread
+};
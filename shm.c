@@ -0,0 +1,239 @@
+// Shared-memory segments.
+//
+// A segment is a set of physical pages named by a key.
+// shm_open() finds or creates the segment with a given key,
+// and shm_attach() maps it into the calling process as a
+// MAP_SHARED region; pagefault() fills the region in from the
+// segment's pages, so every process that attaches it maps the
+// very same pages.  Pages are allocated on first touch.
+//
+// A segment counts the regions that map it.  When the last
+// one goes away (shm_detach(), munmap(), exit() or exec()),
+// the segment and its pages are freed.  A segment that is
+// opened but never attached stays until it is attached and
+// detached again.
+//
+// fork() also gives each MAP_SHARED region of mmap() an unnamed
+// segment (see shmanon), so that the parent and child fault in
+// the pages neither has touched yet from the same pages.
+//
+// A segment's pages are found through a two-level table: a page
+// of pointers to pages of pointers to its pages.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "mman.h"
+
+#define NPTR (PGSIZE/sizeof(char*))  // pointers in a table page
+
+struct shm {
+  int key;                  // 0 if unnamed, or if the slot is unused
+  int ref;                  // regions mapping the segment
+  uint size;                // bytes, a multiple of PGSIZE
+  char ***dir;              // tables of pages, or 0 if none yet
+};
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shm");
+}
+
+// Return the id of the segment with the given key, creating
+// it with size bytes if there is none.  Opening an existing
+// segment never changes its size.  Returns -1 on error.
+int
+shmopen(int key, uint size)
+{
+  struct shm *s, *free;
+
+  if(key == 0)
+    return -1;
+  acquire(&shmtable.lock);
+  free = 0;
+  for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++){
+    if(s->key == key){
+      release(&shmtable.lock);
+      return s - shmtable.shm;
+    }
+    if(s->key == 0 && s->ref == 0 && free == 0)
+      free = s;
+  }
+  size = PGROUNDUP(size);
+  if(free == 0 || size == 0 || size > SHMPAGES*PGSIZE){
+    release(&shmtable.lock);
+    return -1;
+  }
+  free->key = key;
+  free->ref = 0;
+  free->size = size;
+  free->dir = 0;
+  release(&shmtable.lock);
+  return free - shmtable.shm;
+}
+
+// Give MAP_SHARED region v of p, which no segment backs yet, an
+// unnamed one holding the pages p has in it now, indexed by file
+// offset like the region.  The caller holds p's address space
+// lock.  Returns 0 on success, -1 if out of segments or memory.
+int
+shmanon(struct proc *p, struct vma *v)
+{
+  struct shm *s;
+  char *mem;
+  uint a;
+
+  acquire(&shmtable.lock);
+  for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++)
+    if(s->key == 0 && s->ref == 0)
+      break;
+  if(s == &shmtable.shm[NSHM]){
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->ref = 1;
+  s->size = PGROUNDUP(v->off + (v->end - v->start));
+  s->dir = 0;
+  release(&shmtable.lock);
+
+  for(a = v->start; a < v->end; a += PGSIZE){
+    if((mem = uva2ka(p->pgdir, (char*)a)) == 0)
+      continue;
+    if(shmpage(s, v->off + (a - v->start), mem) != mem){
+      shmclose(s);
+      return -1;
+    }
+    kincref(mem);
+  }
+  v->shm = s;
+  return 0;
+}
+
+// Map segment id into the current process.
+// Returns the address of the mapping, or -1.
+int
+shmattach(int id)
+{
+  struct shm *s;
+  struct vma *v;
+  int addr;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtable.shm[id];
+  acquire(&shmtable.lock);
+  if(s->key == 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->ref++;
+  release(&shmtable.lock);
+
+  lockvm(myproc());
+  if((addr = mmap(s->size, PROT_READ|PROT_WRITE, MAP_SHARED, 0, 0)) < 0){
+    unlockvm(myproc());
+    shmclose(s);
+    return -1;
+  }
+  v = findvma(myproc()->leader, addr);
+  v->shm = s;
+  unlockvm(myproc());
+  return addr;
+}
+
+// Unmap the segment mapped at addr in the current process.
+// Returns 0 on success, -1 if no segment is mapped there.
+int
+shmdetach(uint addr)
+{
+  struct vma *v;
+  int r;
+
+  lockvm(myproc());
+  v = findvma(myproc()->leader, addr);
+  if(v == 0 || v->shm == 0 || v->start != addr)
+    r = -1;
+  else
+    r = munmap(v->start, v->end - v->start);
+  unlockvm(myproc());
+  return r;
+}
+
+// Another region maps segment s.
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  s->ref++;
+  release(&shmtable.lock);
+}
+
+// A region mapping segment s has gone away.
+// Free the segment if it was the last one.
+void
+shmclose(struct shm *s)
+{
+  char **tab;
+  int i, j;
+
+  acquire(&shmtable.lock);
+  if(--s->ref > 0){
+    release(&shmtable.lock);
+    return;
+  }
+  if(s->dir){
+    for(i = 0; i < NPTR; i++){
+      if((tab = s->dir[i]) == 0)
+        continue;
+      for(j = 0; j < NPTR; j++)
+        if(tab[j])
+          kfree(tab[j]);
+      kfree((char*)tab);
+    }
+    kfree((char*)s->dir);
+    s->dir = 0;
+  }
+  s->key = 0;
+  release(&shmtable.lock);
+}
+
+// Return the page at byte offset off of segment s.  If it
+// has none yet, mem becomes the page, with the reference the
+// caller holds, unless mem is 0.  The caller must take its
+// own reference to a page it maps with kincref().  Returns 0
+// if off is past the end, there is no page and mem is 0, or
+// out of memory.
+char*
+shmpage(struct shm *s, uint off, char *mem)
+{
+  char **tab, *page;
+  uint i;
+
+  i = off / PGSIZE;
+  page = 0;
+  acquire(&shmtable.lock);
+  if(off >= s->size)
+    goto out;
+  if(s->dir == 0 && (mem == 0 || (s->dir = (char***)kzalloc()) == 0))
+    goto out;
+  if((tab = s->dir[i / NPTR]) == 0){
+    if(mem == 0 || (tab = (char**)kzalloc()) == 0)
+      goto out;
+    s->dir[i / NPTR] = tab;
+  }
+  if((page = tab[i % NPTR]) == 0)
+    page = tab[i % NPTR] = mem;
+out:
+  release(&shmtable.lock);
+  return page;
+}
@@ -28,9 +28,11 @@ acquire(struct spinlock *lk)
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
+  // The xchg is atomic.  While spinning, serve TLB shootdowns:
+  // the CPU holding the lock may be waiting for this one to
+  // flush (see tlbflush), and interrupts are off.
   while(xchg(&lk->locked, 1) != 0)
-    ;
+    tlbintr();
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -0,0 +1,166 @@
+// Swapping.
+//
+// The swap area is NSWAP pages of disk after the file system
+// (see mkfs).  When kallocswap() finds memory exhausted, it has
+// swapout() push cold user pages out to free slots of the swap
+// area: a second-chance clock runs over the LRU list of mapped
+// user pages (see kalloc.c), and evictpage() in vm.c replaces
+// every PTE mapping a page it evicts with the slot holding the
+// page (PTE_SWAP).  Touching the page again faults, and fault()
+// reads it back in.
+//
+// A slot counts the page tables that refer to it: fork()
+// copies swapped-out PTEs as they are, and a page shared
+// copy-on-write is swapped out of all its page tables at once.
+// Each process reads in its own copy of the page.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define SWAPBATCH 8  // pages kallocswap() asks swapout() for
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;            // block number of slot 0
+  uint nslot;            // slots in the swap area
+  uchar ref[NSWAP];      // page tables referring to each slot; 0 if free
+  struct buf buf;        // for swap I/O, which bypasses the buffer cache
+} swap;
+
+void
+swapinit(int dev)
+{
+  struct superblock sb;
+
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.buf.lock, "swapbuf");
+  readsb(dev, &sb);
+  swap.dev = dev;
+  swap.start = sb.swapstart;
+  swap.nslot = sb.nswap;
+  if(swap.nslot > NSWAP)
+    swap.nslot = NSWAP;
+}
+
+// Allocate a free slot.  Returns -1 if swap is full.
+int
+swapalloc(void)
+{
+  int i;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot; i++){
+    if(swap.ref[i] == 0){
+      swap.ref[i] = 1;
+      release(&swap.lock);
+      return i;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Record one more page table referring to slot.
+void
+swapdup(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= swap.nslot || swap.ref[slot] == 0xff)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// A page table no longer refers to slot.
+void
+swapfree(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// Read or write the page at mem from or to slot.
+static void
+swaprw(char *mem, uint slot, int write)
+{
+  struct buf *b;
+  int i;
+
+  b = &swap.buf;
+  acquiresleep(&b->lock);
+  for(i = 0; i < PGBLOCKS; i++){
+    b->dev = swap.dev;
+    b->blockno = swap.start + slot*PGBLOCKS + i;
+    b->data = (uchar*)mem + i*BSIZE;  // straight to or from the page
+    b->flags = write ? B_DIRTY : 0;
+    iderw(b);
+  }
+  releasesleep(&b->lock);
+}
+
+void
+swapwrite(char *mem, uint slot)
+{
+  swaprw(mem, slot, 1);
+}
+
+void
+swapread(char *mem, uint slot)
+{
+  swaprw(mem, slot, 0);
+}
+
+// Free up to n pages by swapping them out.  Pages of an
+// address space whose lock the caller holds are passed over.
+// Returns the number freed.
+int
+swapout(int n)
+{
+  char *mem;
+  int i, nscan, freed, r;
+
+  if(swap.nslot == 0)
+    return 0;
+  freed = 0;
+  // Twice round, so that a page spared for having been
+  // accessed can be evicted on the second visit.
+  nscan = 2*lrusize();
+  for(i = 0; i < nscan && freed < n; i++){
+    if((mem = lrunext()) == 0)
+      break;
+    r = evictpage(mem);
+    kfree(mem);
+    if(r < 0)
+      break;
+    freed += r;
+  }
+  return freed;
+}
+
+// Allocate a page like kalloc(), or if zero is set like
+// kzalloc().  If memory is short, shrink the buffer cache,
+// or failing that swap other pages out.
+// May sleep, so the caller must not hold a spinlock.
+// Returns 0 if there is no memory.
+char*
+kallocswap(int zero)
+{
+  char *mem;
+
+  while((mem = zero ? kzalloc() : kalloc()) == 0)
+    if(bshrink(SWAPBATCH) == 0 && swapout(SWAPBATCH) == 0)
+      return 0;
+  return mem;
+}
@@ -18,30 +18,46 @@ int
 fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
+  struct proc *mm = curproc->leader;
+  int r;
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
-    return -1;
-  *ip = *(int*)(addr);
-  return 0;
+  // Holding the address space lock, neither another thread
+  // nor the swapper can take the page away before it is read.
+  lockvm(curproc);
+  r = -1;
+  if(addr < mm->sz && addr+4 <= mm->sz && faultuvm(mm, addr, 4, 0) == 0){
+    *ip = *(int*)(addr);
+    r = 0;
+  }
+  unlockvm(curproc);
+  return r;
 }
 
 // Fetch the nul-terminated string at addr from the current process.
-// Doesn't actually copy the string - just sets *pp to point at it.
+// Doesn't actually copy the string - just sets *pp to point at it,
+// and pins it until the system call returns (see pinuvm).
 // Returns length of string, not including nul.
 int
 fetchstr(uint addr, char **pp)
 {
   char *s, *ep;
   struct proc *curproc = myproc();
+  struct proc *mm = curproc->leader;
 
-  if(addr >= curproc->sz)
-    return -1;
-  *pp = (char*)addr;
-  ep = (char*)curproc->sz;
-  for(s = *pp; s < ep; s++){
-    if(*s == 0)
+  lockvm(curproc);
+  ep = (char*)mm->sz;
+  for(s = (char*)addr; s < ep; s++){
+    if((s == (char*)addr || (uint)s % PGSIZE == 0) &&
+       faultuvm(mm, (uint)s, 1, 0) < 0)
+      break;
+    if(*s == 0){
+      pinuvm(addr, (uint)s + 1);
+      unlockvm(curproc);
+      *pp = (char*)addr;
       return s - *pp;
+    }
   }
+  unlockvm(curproc);
   return -1;
 }
 
@@ -54,19 +70,52 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
-int
-argptr(int n, char **pp, int size)
+// lies within the process address space, fault in any of its
+// pages that have not been allocated yet, or if write is set
+// that are not writable yet, and pin it until the system call
+// returns (see pinuvm).
+static int
+argbuf(int n, char **pp, int size, int write)
 {
-  int i;
+  int i, r;
   struct proc *curproc = myproc();
- 
+  struct proc *mm = curproc->leader;
+  struct vma *v;
+
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0 || (uint)i + size < (uint)i)
     return -1;
-  *pp = (char*)i;
-  return 0;
+  lockvm(curproc);
+  r = -1;
+  if(((uint)i < mm->sz && (uint)i+size <= mm->sz) ||
+     ((v = findvma(mm, i)) != 0 && (uint)i+size <= v->end)){
+    if(faultuvm(mm, i, size, write) == 0){
+      pinuvm(i, i + size);
+      r = 0;
+    }
+  }
+  unlockvm(curproc);
+  if(r == 0)
+    *pp = (char*)i;
+  return r;
+}
+
+// Fetch the nth system call argument as a pointer to a block
+// of memory of size bytes the system call will read.
+int
+argptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 0);
+}
+
+// Like argptr, for a block of memory the system call will write
+// to: also check that it is writable, and give the process its
+// own copy of any copy-on-write pages in it.
+int
+argoutptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 1);
 }
 
 // Fetch the nth word-sized system call argument as a string pointer.
@@ -103,6 +152,15 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shm_open(void);
+extern int sys_shm_attach(void);
+extern int sys_shm_detach(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_futex(void);
+extern int sys_pstat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -126,6 +184,15 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shm_open]   sys_shm_open,
+[SYS_shm_attach] sys_shm_attach,
+[SYS_shm_detach] sys_shm_detach,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex]   sys_futex,
+[SYS_pstat]   sys_pstat,
 };
 
 void
@@ -137,6 +204,9 @@ syscall(void)
   num = curproc->tf->eax;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     curproc->tf->eax = syscalls[num]();
+    curproc->npin = 0;
+    while(curproc->nargfile > 0)
+      fileclose(curproc->argfile[--curproc->nargfile]);
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             curproc->pid, curproc->name, num);
@@ -20,3 +20,12 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_shm_open   24
+#define SYS_shm_attach 25
+#define SYS_shm_detach 26
+#define SYS_clone  27
+#define SYS_join   28
+#define SYS_futex  29
+#define SYS_pstat  30
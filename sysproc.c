@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "pstat.h"
 
 int
 sys_fork(void)
@@ -50,9 +51,11 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
+  lockvm(myproc());
+  addr = myproc()->leader->sz;
   if(growproc(n) < 0)
-    return -1;
+    addr = -1;
+  unlockvm(myproc());
   return addr;
 }
 
@@ -89,3 +92,78 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+int
+sys_shm_open(void)
+{
+  int key, size;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmopen(key, size);
+}
+
+int
+sys_shm_attach(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmattach(id);
+}
+
+int
+sys_shm_detach(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return shmdetach(addr);
+}
+
+int
+sys_clone(void)
+{
+  int fcn, arg, stack;
+
+  if(argint(0, &fcn) < 0 || argint(1, &arg) < 0 || argint(2, &stack) < 0)
+    return -1;
+  return clone(fcn, arg, stack);
+}
+
+int
+sys_join(void)
+{
+  char *stack;
+
+  if(argptr(0, &stack, sizeof(uint)) < 0)
+    return -1;
+  return join((uint)stack);
+}
+
+int
+sys_futex(void)
+{
+  int addr, op, val;
+
+  if(argint(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  return futex(addr, op, val);
+}
+
+int
+sys_pstat(void)
+{
+  struct pstat *ps;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0)
+    return -1;
+  if(n > NPROC)
+    n = NPROC;
+  if(argoutptr(0, (char**)&ps, n*sizeof(*ps)) < 0)
+    return -1;
+  return pstat(ps, n);
+}
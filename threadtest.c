@@ -0,0 +1,167 @@
+// Test clone() and join() through the thread library in ulib.c,
+// and the futex-based locks built on them.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "futex.h"
+
+// threads share memory, including heap pages that
+// one of them faults in, and are joined.
+enum { NTHREAD = 4, NCOUNT = 1000 };
+int threadcount[NTHREAD];
+char *threadheap;
+
+void
+threadfn(void *arg)
+{
+  int i, n;
+
+  n = (int)arg;
+  for(i = 0; i < NCOUNT; i++)
+    threadcount[n]++;
+  threadheap[n*4096] = 't';
+  exit();
+}
+
+void
+spinfn(void *arg)
+{
+  for(;;)
+    ;
+}
+
+void
+threadtest(void)
+{
+  int i, pid;
+
+  printf(1, "thread test\n");
+  threadheap = sbrk(NTHREAD*4096);
+  for(i = 0; i < NTHREAD; i++){
+    if(thread_create(threadfn, (void*)i) < 0){
+      printf(1, "thread test create failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < NTHREAD; i++){
+    if(thread_join() < 0){
+      printf(1, "thread test join failed\n");
+      exit();
+    }
+  }
+  if(thread_join() != -1){
+    printf(1, "thread test joined a thread twice\n");
+    exit();
+  }
+  for(i = 0; i < NTHREAD; i++){
+    if(threadcount[i] != NCOUNT || threadheap[i*4096] != 't'){
+      printf(1, "thread test thread %d's writes lost\n", i);
+      exit();
+    }
+  }
+  sbrk(-NTHREAD*4096);
+
+  // exiting takes running threads along
+  pid = fork();
+  if(pid == 0){
+    thread_create(spinfn, 0);
+    exit();
+  }
+  if(wait() != pid){
+    printf(1, "thread test wait failed\n");
+    exit();
+  }
+  printf(1, "thread test OK\n");
+}
+
+// a mutex keeps increments from being lost, and a
+// condition variable hands values from thread to thread.
+struct mutex lock;
+struct cond changed;
+int counter, slot, nslot;
+
+void
+lockfn(void *arg)
+{
+  int i;
+
+  for(i = 0; i < NCOUNT; i++){
+    mutex_lock(&lock);
+    counter++;
+    mutex_unlock(&lock);
+  }
+  exit();
+}
+
+void
+producer(void *arg)
+{
+  int i;
+
+  for(i = 1; i <= NCOUNT; i++){
+    mutex_lock(&lock);
+    while(nslot != 0)
+      cond_wait(&changed, &lock);
+    slot = i;
+    nslot = 1;
+    cond_broadcast(&changed);
+    mutex_unlock(&lock);
+  }
+  exit();
+}
+
+void
+futextest(void)
+{
+  int i, sum;
+
+  printf(1, "futex test\n");
+  for(i = 0; i < NTHREAD; i++){
+    if(thread_create(lockfn, 0) < 0){
+      printf(1, "futex test create failed\n");
+      exit();
+    }
+  }
+  while(thread_join() >= 0)
+    ;
+  if(counter != NTHREAD*NCOUNT){
+    printf(1, "futex test lost increments: %d\n", counter);
+    exit();
+  }
+
+  if(thread_create(producer, 0) < 0){
+    printf(1, "futex test create failed\n");
+    exit();
+  }
+  sum = 0;
+  for(i = 1; i <= NCOUNT; i++){
+    mutex_lock(&lock);
+    while(nslot == 0)
+      cond_wait(&changed, &lock);
+    sum += slot;
+    nslot = 0;
+    cond_broadcast(&changed);
+    mutex_unlock(&lock);
+  }
+  thread_join();
+  if(sum != NCOUNT*(NCOUNT+1)/2){
+    printf(1, "futex test condition variable lost values\n");
+    exit();
+  }
+
+  // waiting on a value that has already changed returns at once
+  if(futex(&counter, FUTEX_WAIT, counter+1) != -1){
+    printf(1, "futex test wait on stale value\n");
+    exit();
+  }
+  printf(1, "futex test OK\n");
+}
+
+int
+main(void)
+{
+  threadtest();
+  futextest();
+  exit();
+}
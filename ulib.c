@@ -3,6 +3,9 @@
 #include "fcntl.h"
 #include "user.h"
 #include "x86.h"
+#include "mman.h"
+#include "futex.h"
+#include "param.h"
 
 char*
 strcpy(char *s, const char *t)
@@ -104,3 +107,104 @@ memmove(void *vdst, const void *vsrc, int n)
     *dst++ = *src++;
   return vdst;
 }
+
+// Threads.  Each thread runs on its own stack, mapped with
+// mmap() and unmapped again by thread_join().
+#define THREADSTACK (4*4096)
+
+struct threadstart {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static void
+threadmain(void *a)
+{
+  struct threadstart *ts = a;
+
+  ts->fn(ts->arg);
+  exit();
+}
+
+// Start a thread running fn(arg).  Returns its pid, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  struct threadstart *ts;
+  int pid;
+
+  stack = mmap(0, THREADSTACK, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(stack == MAP_FAILED)
+    return -1;
+  ts = (struct threadstart*)(stack + THREADSTACK) - 1;
+  ts->fn = fn;
+  ts->arg = arg;
+  if((pid = clone(threadmain, ts, ts)) < 0)
+    munmap(stack, THREADSTACK);
+  return pid;
+}
+
+// Wait for a thread to exit and free its stack.
+// Returns its pid, or -1 if there are no threads.
+int
+thread_join(void)
+{
+  void *stack;
+  int pid;
+
+  if((pid = join(&stack)) >= 0)
+    munmap((char*)stack - THREADSTACK + sizeof(struct threadstart), THREADSTACK);
+  return pid;
+}
+
+// Mutexes and condition variables.  The uncontended paths stay
+// in user space; futex() is called only to sleep or to wake a
+// sleeper.  The mutex is the one from Drepper's "Futexes Are
+// Tricky", using only xchg.
+void
+mutex_lock(struct mutex *m)
+{
+  if(xchg(&m->state, 1) == 0)
+    return;
+  // Mark the mutex contended before sleeping, so that
+  // the holder's unlock wakes someone.
+  while(xchg(&m->state, 2) != 0)
+    futex(&m->state, FUTEX_WAIT, 2);
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(xchg(&m->state, 0) == 2)
+    futex(&m->state, FUTEX_WAKE, 1);
+}
+
+// Release m, sleep until signaled, and reacquire m.
+// As with any condition variable, the caller must
+// recheck its condition in a loop.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  uint seq;
+
+  seq = c->seq;
+  mutex_unlock(m);
+  futex(&c->seq, FUTEX_WAIT, seq);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex(&c->seq, FUTEX_WAKE, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex(&c->seq, FUTEX_WAKE, NPROC);
+}
@@ -1,5 +1,16 @@
 struct stat;
 struct rtcdate;
+struct pstat;
+
+// Locks for threads and processes sharing memory (see ulib.c).
+// Zero-initialized ones are ready to use.
+struct mutex {
+  uint state;  // 0 unlocked, 1 locked, 2 locked with waiters
+};
+
+struct cond {
+  uint seq;    // bumped by every signal
+};
 
 // system calls
 int fork(void);
@@ -23,6 +34,15 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, int);
+int munmap(void*, uint);
+int shm_open(int, uint);
+void* shm_attach(int);
+int shm_detach(void*);
+int clone(void(*)(void*), void*, void*);
+int join(void**);
+int futex(void*, int, int);
+int pstat(struct pstat*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -37,3 +57,10 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+int thread_create(void(*)(void*), void*);
+int thread_join(void);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -7,6 +7,8 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "mman.h"
+#include "pstat.h"
 
 char buf[8192];
 char name[3];
@@ -1411,6 +1413,138 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// fork() shares pages copy-on-write; check that parent and
+// child each see only their own writes, including writes the
+// kernel makes on the child's behalf in read().
+void
+cowtest(void)
+{
+  enum { N = 64*4096 };
+  char *p;
+  int i, pid, fds[2];
+
+  printf(stdout, "cow test\n");
+  p = sbrk(N);
+  if(p == (char*)0xffffffff){
+    printf(stdout, "cow test sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < N; i += 4096)
+    p[i] = 'a';
+  if(pipe(fds) != 0){
+    printf(stdout, "cow test pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "cow test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i += 4096){
+      if(p[i] != 'a'){
+        printf(stdout, "cow test child saw wrong data\n");
+        exit();
+      }
+      p[i] = 'b';
+    }
+    if(read(fds[0], p, 1) != 1 || p[0] != 'z'){
+      printf(stdout, "cow test read into shared page failed\n");
+      exit();
+    }
+    exit();
+  }
+  write(fds[1], "z", 1);
+  wait();
+  close(fds[0]);
+  close(fds[1]);
+  for(i = 0; i < N; i += 4096){
+    if(p[i] != 'a'){
+      printf(stdout, "cow test parent saw child's write\n");
+      exit();
+    }
+    p[i] = 'c';
+  }
+  sbrk(-N);
+  printf(stdout, "cow test OK\n");
+}
+
+// Pages swapped out of the process.
+int
+swapped(int pid)
+{
+  static struct pstat ps[NPROC];
+  int i, n;
+
+  n = pstat(ps, NPROC);
+  for(i = 0; i < n; i++)
+    if(ps[i].pid == pid)
+      return ps[i].swap;
+  return -1;
+}
+
+// touch more memory than the machine has, so that pages go
+// out to swap, and check what comes back.
+void
+swaptest(void)
+{
+  enum { N = (PHYSTOP/4096) + 1024 };
+  char *p;
+  int i, n, pid, fds[2];
+
+  printf(stdout, "swap test\n");
+  if(pipe(fds) != 0){
+    printf(stdout, "swap test pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "swap test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    p = sbrk(N*4096);
+    if(p == (char*)0xffffffff){
+      printf(stdout, "swap test sbrk failed\n");
+      exit();
+    }
+    // Stop a little after the first pages go out: swap
+    // space is much smaller than memory.
+    for(n = 0; n < N; n++){
+      *(int*)(p + n*4096) = n;
+      p[n*4096 + 4095] = n;
+      if(n % 64 == 0 && swapped(getpid()) > 0)
+        break;
+    }
+    if(n == N){
+      printf(stdout, "swap test nothing swapped out\n");
+      exit();
+    }
+    for(i = 0; i < 64 && n+1 < N; i++){
+      n++;
+      *(int*)(p + n*4096) = n;
+      p[n*4096 + 4095] = n;
+    }
+    for(i = n; i >= 0; i--){
+      if(*(int*)(p + i*4096) != i || p[i*4096 + 4095] != (char)i){
+        printf(stdout, "swap test page %d came back wrong\n", i);
+        exit();
+      }
+    }
+    write(fds[1], "x", 1);
+    exit();
+  }
+  close(fds[1]);
+  wait();
+  if(read(fds[0], buf, 1) != 1){
+    printf(stdout, "swap test failed\n");
+    exit();
+  }
+  close(fds[0]);
+  printf(stdout, "swap test OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1546,6 +1680,228 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// sbrk() only reserves address space; pages appear on first
+// touch, whether by the process or by the kernel on its behalf.
+void
+lazysbrktest(void)
+{
+  enum { HUGE = 1024*1024*1024 };
+  char *a, *p;
+  int fds[2];
+
+  printf(stdout, "lazy sbrk test\n");
+  a = sbrk(0);
+  p = sbrk(HUGE);
+  if(p != a){
+    printf(stdout, "lazy sbrk could not reserve %d bytes\n", HUGE);
+    exit();
+  }
+  if(p[0] != 0 || p[HUGE/2] != 0 || p[HUGE-1] != 0){
+    printf(stdout, "lazy sbrk page not zeroed\n");
+    exit();
+  }
+  p[HUGE/2] = 'x';
+  if(pipe(fds) != 0){
+    printf(stdout, "lazy sbrk pipe failed\n");
+    exit();
+  }
+  // the kernel writes into an untouched page
+  write(fds[1], "y", 1);
+  if(read(fds[0], p + HUGE/4, 1) != 1 || p[HUGE/4] != 'y'){
+    printf(stdout, "lazy sbrk read into untouched page failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(sbrk(-HUGE) == (char*)0xffffffff || sbrk(0) != a){
+    printf(stdout, "lazy sbrk could not shrink\n");
+    exit();
+  }
+  printf(stdout, "lazy sbrk test OK\n");
+}
+
+// mmap() of files and of anonymous memory, private and shared.
+void
+mmaptest(void)
+{
+  enum { N = 2*4096 + 100 };
+  int fd, i, n, pid, ppid, fds[2];
+  char *p, *q;
+
+  printf(stdout, "mmap test\n");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "mmap test create failed\n");
+    exit();
+  }
+  for(i = 0; i < N; i++)
+    buf[i % sizeof(buf)] = 'a' + i % 26;
+  for(i = 0; i < N; i += 1024)
+    write(fd, buf + (i % sizeof(buf)), N - i < 1024 ? N - i : 1024);
+  close(fd);
+
+  // private mapping: reads the file, writes stay private
+  fd = open("mmapfile", O_RDONLY);
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap test private mmap failed\n");
+    exit();
+  }
+  for(i = 0; i < N; i++){
+    if(p[i] != 'a' + i % 26){
+      printf(stdout, "mmap test private read wrong at %d\n", i);
+      exit();
+    }
+  }
+  if(p[N] != 0){
+    printf(stdout, "mmap test past end of file not zero\n");
+    exit();
+  }
+  p[0] = 'X';
+  if(munmap(p, N) < 0){
+    printf(stdout, "mmap test munmap failed\n");
+    exit();
+  }
+
+  // pages wholly past the end of the file are zeros too
+  p = mmap(0, N + 2*4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap test long mmap failed\n");
+    exit();
+  }
+  if(p[N + 4096] != 0 || p[N + 2*4096 - 1] != 0){
+    printf(stdout, "mmap test page past end of file not zero\n");
+    exit();
+  }
+  munmap(p, N + 2*4096);
+  close(fd);
+
+  // shared mapping: writes reach the file
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap test shared mmap failed\n");
+    exit();
+  }
+  if(p[0] != 'a'){
+    printf(stdout, "mmap test private write reached the file\n");
+    exit();
+  }
+  p[1] = 'Y';
+  p[N-1] = 'Z';
+  munmap(p, N);
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 2) != 2 || buf[1] != 'Y'){
+    printf(stdout, "mmap test shared write lost\n");
+    exit();
+  }
+  for(i = 2; i < N; i += n)
+    if((n = read(fd, buf, N - i < sizeof(buf) ? N - i : sizeof(buf))) <= 0)
+      break;
+  if(i != N || buf[n-1] != 'Z'){
+    printf(stdout, "mmap test shared write to last page lost\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  // anonymous shared memory is shared with fork children,
+  // even pages first touched after the fork, and the kernel
+  // can read and write it
+  q = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(q == MAP_FAILED || q[0] != 0){
+    printf(stdout, "mmap test anonymous mmap failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "mmap test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    q[0] = 'c';
+    q[4096] = 'd';
+    exit();
+  }
+  wait();
+  if(q[0] != 'c' || q[4096] != 'd'){
+    printf(stdout, "mmap test child's write not shared\n");
+    exit();
+  }
+  if(pipe(fds) != 0){
+    printf(stdout, "mmap test pipe failed\n");
+    exit();
+  }
+  if(write(fds[1], q, 1) != 1 || read(fds[0], q + 1, 1) != 1 || q[1] != 'c'){
+    printf(stdout, "mmap test pipe through mapping failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  munmap(q, 2*4096);
+
+  // touching an unmapped region kills the process
+  ppid = getpid();
+  pid = fork();
+  if(pid == 0){
+    printf(stdout, "mmap test could read %x after munmap\n", q[0]);
+    kill(ppid);
+    exit();
+  }
+  wait();
+
+  printf(stdout, "mmap test OK\n");
+}
+
+// shared-memory segments are seen by unrelated attachers
+// and go away with the last one.
+void
+shmtest(void)
+{
+  enum { KEY = 0x5348, N = 3*4096 };
+  int id, pid;
+  char *p;
+
+  printf(stdout, "shm test\n");
+  id = shm_open(KEY, N);
+  if(id < 0 || (p = shm_attach(id)) == (char*)-1){
+    printf(stdout, "shm test attach failed\n");
+    exit();
+  }
+  p[0] = 'p';
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "shm test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    // detach the inherited mapping and attach anew by key
+    shm_detach(p);
+    p = shm_attach(shm_open(KEY, 0));
+    if(p == (char*)-1 || p[0] != 'p'){
+      printf(stdout, "shm test child attach failed\n");
+      exit();
+    }
+    p[N-1] = 'c';
+    exit();
+  }
+  wait();
+  if(p[N-1] != 'c'){
+    printf(stdout, "shm test child's write not shared\n");
+    exit();
+  }
+  if(shm_detach(p + 4096) != -1 || shm_detach(p) != 0){
+    printf(stdout, "shm test detach failed\n");
+    exit();
+  }
+  if(shm_attach(id) != (char*)-1){
+    printf(stdout, "shm test segment outlived its last attach\n");
+    exit();
+  }
+  printf(stdout, "shm test OK\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1768,6 +2124,11 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  lazysbrktest();
+  cowtest();
+  swaptest();
+  mmaptest();
+  shmtest();
   validatetest();
 
   opentest();
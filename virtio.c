@@ -0,0 +1,330 @@
+// Driver for a virtio block device, through the legacy
+// (virtio 0.9.5) PCI interface that QEMU provides.
+//
+// The driver and the disk share a virtqueue: a table of
+// descriptors of memory buffers, an available ring in which
+// the driver places requests, and a used ring in which the
+// disk returns them when done.  Each request is a chain of
+// descriptors: a header naming the operation and sector, the
+// data of one buffer or of up to VQMERGE buffers holding
+// consecutive blocks, and a status byte the disk fills in.  As
+// many requests as there are descriptors for can be in flight
+// at once; the disk finishes them in any order.  Buffers wait
+// in vdisk.queue for descriptors, and are started in the order
+// the I/O scheduler picks (see elevator.c), which merges
+// requests for consecutive blocks.
+//
+// ide.c hands requests for disk 1 to the driver if there is a
+// virtio disk and no IDE disk 1.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "pci.h"
+#include "elevator.h"
+
+#define SECTOR_SIZE   512
+
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK    0x1001  // legacy block device ID
+
+// Legacy virtio registers, at offsets from vdisk.iobase.
+#define VIO_FEATURES  0x00  // features the device offers
+#define VIO_GFEATURES 0x04  // features the driver accepts
+#define VIO_QPFN      0x08  // physical page number of the queue
+#define VIO_QSIZE     0x0c
+#define VIO_QSEL      0x0e
+#define VIO_QNOTIFY   0x10
+#define VIO_STATUS    0x12
+#define VIO_ISR       0x13  // reading acknowledges the interrupt
+#define VIO_CAPACITY  0x14  // disk size in sectors, 64 bits
+
+// VIO_STATUS bits.
+#define VS_ACK        0x01
+#define VS_DRIVER     0x02
+#define VS_OK         0x04
+#define VS_FAILED     0x80
+
+#define VQMAX         256   // largest queue the driver handles
+#define VQDESC        3     // descriptors for a one-buffer request
+#define VQMERGE       32    // most buffers in one request
+
+struct vdesc {
+  uint addr;       // physical address, 64 bits
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;     // next descriptor if VD_NEXT
+};
+#define VD_NEXT  0x1
+#define VD_WRITE 0x2   // the disk writes the buffer
+
+struct vavail {
+  ushort flags;
+  ushort idx;      // where the driver puts the next request
+  ushort ring[];
+};
+
+struct vusedelem {
+  uint id;         // head descriptor of a finished request
+  uint len;
+};
+
+struct vused {
+  ushort flags;
+  volatile ushort idx;  // where the disk puts the next request
+  struct vusedelem ring[];
+};
+
+// The header of a virtio-blk request.
+struct vblkhdr {
+  uint type;
+  uint reserved;
+  uint sector;     // 64 bits
+  uint sectorhi;
+};
+#define VBLK_IN  0     // read
+#define VBLK_OUT 1     // write
+
+int virtioirq;     // IRQ of the virtio disk; 0 if none
+
+static struct {
+  struct spinlock lock;
+  ushort iobase;
+  uint capacity;         // sectors
+  int qsize;             // entries in the queue
+  struct vdesc *desc;
+  struct vavail *avail;
+  struct vused *used;
+  int freedesc;          // free descriptors, linked by next
+  int nfree;
+  ushort usedidx;        // used ring entries seen
+  struct {
+    struct vblkhdr hdr;
+    uchar status;
+    struct buf *b;
+  } req[VQMAX];          // requests, by head descriptor
+  struct elevq queue;    // buffers waiting for descriptors
+} vdisk;
+
+// The virtqueue, which must be physically contiguous
+// and page-aligned.
+static char vqmem[3*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Set up the virtio disk, if there is one.
+// Returns 0 on success, -1 if there is no usable disk.
+int
+virtioinit(void)
+{
+  int tag, i, n, irq;
+  uint bar;
+  ushort io;
+
+  initlock(&vdisk.lock, "virtio");
+  elvinit(&vdisk.queue, &IOSCHED);
+  if((tag = pcifindid(VIRTIO_VENDOR, VIRTIO_BLK)) < 0)
+    return -1;
+  bar = pciread(tag, PCI_BAR0);
+  irq = pciread(tag, PCI_INTR) & 0xff;
+  if(!(bar & 1) || irq == 0 || irq >= 24)
+    return -1;
+  io = bar & ~3;
+  pciwrite(tag, PCI_CMD, pciread(tag, PCI_CMD) | PCI_CMD_IO | PCI_CMD_MASTER);
+
+  outb(io + VIO_STATUS, 0);  // reset
+  outb(io + VIO_STATUS, VS_ACK);
+  outb(io + VIO_STATUS, VS_ACK|VS_DRIVER);
+  outl(io + VIO_GFEATURES, 0);  // none of the optional features
+
+  // The legacy interface lays the queue out for its
+  // own size, which the driver cannot change.
+  outw(io + VIO_QSEL, 0);
+  n = inw(io + VIO_QSIZE);
+  if(n < VQDESC || n > VQMAX || (n & (n-1))){
+    outb(io + VIO_STATUS, VS_FAILED);
+    return -1;
+  }
+  vdisk.qsize = n;
+  vdisk.desc = (struct vdesc*)vqmem;
+  vdisk.avail = (struct vavail*)(vqmem + n*sizeof(struct vdesc));
+  vdisk.used = (struct vused*)(vqmem +
+    PGROUNDUP(n*sizeof(struct vdesc) + sizeof(struct vavail) + (n+1)*sizeof(ushort)));
+  for(i = 0; i < n; i++)
+    vdisk.desc[i].next = i+1;
+  vdisk.freedesc = 0;
+  vdisk.nfree = n;
+  outl(io + VIO_QPFN, V2P(vqmem) / PGSIZE);
+
+  vdisk.capacity = inl(io + VIO_CAPACITY);
+  if(inl(io + VIO_CAPACITY + 4) != 0)
+    vdisk.capacity = 0xffffffff;
+  vdisk.iobase = io;
+  virtioirq = irq;
+  ioapicenable(irq, ncpu - 1);
+  outb(io + VIO_STATUS, VS_ACK|VS_DRIVER|VS_OK);
+  return 0;
+}
+
+// Fill in descriptor d.
+static void
+vdesc(int d, void *addr, uint len, int flags, int next)
+{
+  vdisk.desc[d].addr = V2P(addr);
+  vdisk.desc[d].addrhi = 0;
+  vdisk.desc[d].len = len;
+  vdisk.desc[d].flags = flags;
+  vdisk.desc[d].next = next;
+}
+
+static int
+valloc(void)
+{
+  int d;
+
+  if(vdisk.nfree == 0)
+    panic("valloc");
+  d = vdisk.freedesc;
+  vdisk.freedesc = vdisk.desc[d].next;
+  vdisk.nfree--;
+  return d;
+}
+
+// Free the chain of descriptors starting at d.
+static void
+vfree(int d)
+{
+  int next;
+
+  for(;;){
+    next = vdisk.desc[d].next;
+    vdisk.desc[d].next = vdisk.freedesc;
+    vdisk.freedesc = d;
+    vdisk.nfree++;
+    if(!(vdisk.desc[d].flags & VD_NEXT))
+      break;
+    d = next;
+  }
+}
+
+// Hand the request for b and the buffers chained to it,
+// which hold consecutive blocks, to the disk.  Caller holds
+// vdisk.lock and has checked that there are enough free
+// descriptors.
+static void
+vstart(struct buf *b)
+{
+  struct buf *p;
+  int d0, d, prev;
+
+  d0 = valloc();
+  vdisk.req[d0].hdr.type = (b->flags & B_DIRTY) ? VBLK_OUT : VBLK_IN;
+  vdisk.req[d0].hdr.reserved = 0;
+  vdisk.req[d0].hdr.sector = b->blockno * (BSIZE/SECTOR_SIZE);
+  vdisk.req[d0].hdr.sectorhi = 0;
+  vdisk.req[d0].status = 0xff;
+  vdisk.req[d0].b = b;
+  vdesc(d0, &vdisk.req[d0].hdr, sizeof(struct vblkhdr), VD_NEXT, 0);
+  prev = d0;
+  for(p = b; p; p = p->qnext){
+    d = valloc();
+    vdisk.desc[prev].next = d;
+    vdesc(d, p->data, BSIZE, ((b->flags & B_DIRTY) ? 0 : VD_WRITE) | VD_NEXT, 0);
+    prev = d;
+  }
+  d = valloc();
+  vdisk.desc[prev].next = d;
+  vdesc(d, &vdisk.req[d0].status, 1, VD_WRITE, 0);
+
+  vdisk.avail->ring[vdisk.avail->idx % vdisk.qsize] = d0;
+  __sync_synchronize();  // the disk must see the ring entry first
+  vdisk.avail->idx++;
+  __sync_synchronize();
+  outw(vdisk.iobase + VIO_QNOTIFY, 0);
+}
+
+// Start as many waiting requests as there are free
+// descriptors for.  Caller holds vdisk.lock.
+static void
+vkick(void)
+{
+  struct buf *b;
+  int max;
+
+  for(;;){
+    max = vdisk.nfree - (VQDESC-1);
+    if(max > VQMERGE)
+      max = VQMERGE;
+    if(max < 1 || (b = elvnext(&vdisk.queue, max)) == 0)
+      break;
+    vstart(b);
+  }
+}
+
+// Start syncing b with the disk, without waiting.
+// See idesubmit.
+void
+virtiosubmit(struct buf *b)
+{
+  if((b->blockno+1) * (BSIZE/SECTOR_SIZE) > vdisk.capacity)
+    panic("virtio: incorrect blockno");
+
+  acquire(&vdisk.lock);
+  elvadd(&vdisk.queue, b);
+  vkick();
+  release(&vdisk.lock);
+}
+
+// Wait for the request virtiosubmit() started for b to finish.
+void
+virtiocomplete(struct buf *b)
+{
+  acquire(&vdisk.lock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &vdisk.lock);
+  release(&vdisk.lock);
+}
+
+// Interrupt handler.
+void
+virtiointr(void)
+{
+  struct buf *b, *next;
+  int d;
+
+  acquire(&vdisk.lock);
+  inb(vdisk.iobase + VIO_ISR);
+
+  // Finish every request the disk has returned.
+  while(vdisk.usedidx != vdisk.used->idx){
+    __sync_synchronize();
+    d = vdisk.used->ring[vdisk.usedidx % vdisk.qsize].id;
+    vdisk.usedidx++;
+    b = vdisk.req[d].b;
+    if(vdisk.req[d].status != 0)
+      panic("virtio: I/O error");
+    vdisk.req[d].b = 0;
+    vfree(d);
+
+    for(; b; b = next){
+      next = b->qnext;
+      b->flags |= B_VALID;
+      b->flags &= ~B_DIRTY;
+      wakeup(b);
+      if(b->iodone)
+        b->iodone(b);
+    }
+  }
+
+  // Start waiting requests in the descriptors freed.
+  vkick();
+
+  release(&vdisk.lock);
+}
@@ -6,9 +6,18 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "mman.h"
+#include "traps.h"
+#include "frame.h"
+#include "pstat.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
+static uint kglobal;  // PTE_G if the CPUs support global pages
 
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
@@ -42,10 +51,9 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kzalloc()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -79,6 +87,21 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
   return 0;
 }
 
+// Map the user page mem at va in pgdir, recording the
+// mapping in mem's frame.  Returns 0 on success, -1 if
+// out of memory.
+static int
+mapuser(pde_t *pgdir, char *va, char *mem, int perm)
+{
+  if(rmapadd(mem, pgdir, (uint)va) < 0)
+    return -1;
+  if(mappages(pgdir, va, PGSIZE, V2P(mem), perm) < 0){
+    rmapremove(mem, pgdir, (uint)va);
+    return -1;
+  }
+  return 0;
+}
+
 // There is one page table per process, plus one that's used when
 // a CPU is not running any process (kpgdir). The kernel uses the
 // current process's page table during system calls and interrupts;
@@ -99,6 +122,10 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 // The kernel allocates physical memory for its heap and for user memory
 // between V2P(end) and the end of physical memory (PHYSTOP)
 // (directly addressable from end..P2V(PHYSTOP)).
+//
+// Above the first 4 Mbytes, where the kernel's text and data live,
+// the kernel mappings use 4-Mbyte pages (PTE_PS, enabled by entry.S),
+// so they need no page tables and few TLB entries.
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -114,36 +141,87 @@ static struct kmap {
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Like mappages(), for a kmap entry: wherever va and pa are both
+// 4-Mbyte aligned, map a whole 4-Mbyte page from the page directory.
+static int
+kmappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
+{
+  char *a;
+  uint n;
+
+  a = va;
+  while(size > 0){
+    if((uint)a % PTSIZE == 0 && pa % PTSIZE == 0 && size >= PTSIZE){
+      pgdir[PDX(a)] = pa | perm | PTE_P | PTE_PS;
+      n = PTSIZE;
+    } else {
+      // Small pages up to the next 4-Mbyte boundary.
+      n = PTSIZE - (uint)a % PTSIZE;
+      if(n > size)
+        n = size;
+      if(mappages(pgdir, a, n, pa, perm) < 0)
+        return -1;
+    }
+    a += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// Set up kernel part of a page table.  The kernel's page tables
+// are built once, in kpgdir, and every page directory points at
+// the same ones, so the kernel mappings must not change after boot.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
   if((pgdir = (pde_t*)kalloc()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
-      freevm(pgdir);
-      return 0;
-    }
+  memset(pgdir, 0, PDX(KERNBASE) * sizeof(pde_t));
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes, and build the kernel page tables
+// that setupkvm() shares with every process.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+  uint eax, ebx, ecx, edx;
+
+  // The kernel mappings are the same in every page table and
+  // never change, so they can be global: switchuvm()'s %cr3
+  // load then flushes only the user part of the TLB.
+  cpuinfo(1, &eax, &ebx, &ecx, &edx);
+  if(edx & CPUID_PGE)
+    kglobal = PTE_G;
+
+  if((kpgdir = (pde_t*)kalloc()) == 0)
+    panic("kvmalloc");
+  memset(kpgdir, 0, PGSIZE);
+  if (P2V(PHYSTOP) > (void*)DEVSPACE)
+    panic("PHYSTOP too high");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(kmappages(kpgdir, k->virt, k->phys_end - k->phys_start,
+                 (uint)k->phys_start, k->perm | kglobal) < 0)
+      panic("kvmalloc");
   switchkvm();
 }
 
+// Honor PTE_G on this CPU, if kvmalloc() used it.
+// Run once on entry on each CPU.
+void
+pgeinit(void)
+{
+  if(kglobal)
+    lcr4(rcr4() | CR4_PGE);
+}
+
 // Switch h/w page table register to the kernel-only page table,
 // for when no process is running.
 void
@@ -173,10 +251,98 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
+  // Record the page table before loading it, for tlbflush().
+  mycpu()->pgdir = p->pgdir;
   lcr3(V2P(p->pgdir));  // switch to process's address space
   popcli();
 }
 
+// TLB shootdown.  After changing or removing user PTEs, the TLBs
+// of other CPUs using the same page table (threads of one process)
+// may still hold the old translations.  tlbflush() flushes them
+// on this CPU and interrupts just the CPUs whose cpu->pgdir is the
+// page table, waiting until they have flushed as well.  Callers
+// must flush before freeing a page that was mapped.  They may
+// hold a spinlock: a CPU spinning for it in acquire() serves
+// the shootdown while it waits.
+static struct {
+  volatile uint busy;       // a CPU is sending a shootdown
+  pde_t *pgdir;
+  uint va;
+  uint len;
+  volatile uint pending;    // bit i set: cpus[i] has not flushed yet
+} shootdown;
+
+// Flush [va, va+len) from this CPU's TLB.
+static void
+tlbflush1(uint va, uint len)
+{
+  uint a;
+
+  if(len > 32*PGSIZE){
+    // Cheaper to flush the whole (non-global) TLB.
+    lcr3(V2P(mycpu()->pgdir));
+    return;
+  }
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    invlpg((void*)a);
+}
+
+// Flush the TLB entries of user addresses [va, va+len)
+// in pgdir on every CPU that may hold them.
+void
+tlbflush(pde_t *pgdir, uint va, uint len)
+{
+  struct cpu *c;
+  uint mask;
+
+  pushcli();
+  if(mycpu()->pgdir == pgdir)
+    tlbflush1(va, len);
+  // The PTE changes must be visible before cpu->pgdir is read:
+  // a CPU that loads pgdir after this will see them.
+  __sync_synchronize();
+  mask = 0;
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(c != mycpu() && c->pgdir == pgdir)
+      mask |= 1 << (c - cpus);
+  if(mask){
+    // Serve shootdowns aimed at this CPU while waiting our turn;
+    // interrupts are off, so tlbintr() cannot run otherwise.
+    while(xchg(&shootdown.busy, 1) != 0)
+      tlbintr();
+    shootdown.pgdir = pgdir;
+    shootdown.va = va;
+    shootdown.len = len;
+    shootdown.pending = mask;
+    for(c = cpus; c < cpus+ncpu; c++)
+      if(mask & (1 << (c - cpus)))
+        lapicipi(c->apicid, T_TLBFLUSH);
+    while(shootdown.pending)
+      ;
+    xchg(&shootdown.busy, 0);
+  }
+  popcli();
+}
+
+// Carry out a shootdown aimed at this CPU, if there is one.
+// Called with interrupts off.
+void
+tlbintr(void)
+{
+  uint bit;
+
+  if(shootdown.pending == 0)
+    return;
+  bit = 1 << cpuid();
+  if((shootdown.pending & bit) == 0)
+    return;
+  // A CPU that has since switched page tables has nothing to flush.
+  if(mycpu()->pgdir == shootdown.pgdir)
+    tlbflush1(shootdown.va, shootdown.len);
+  __sync_fetch_and_and(&shootdown.pending, ~bit);
+}
+
 // Load the initcode into address 0 of pgdir.
 // sz must be less than a page.
 void
@@ -186,36 +352,12 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
-  mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
+  mem = kzalloc();
+  if(mapuser(pgdir, 0, mem, PTE_W|PTE_U) < 0)
+    panic("inituvm");
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
-{
-  uint i, pa, n;
-  pte_t *pte;
-
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
-      return -1;
-  }
-  return 0;
-}
-
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -231,14 +373,13 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kallocswap(1);
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    if(mapuser(pgdir, (char*)a, mem, PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
       kfree(mem);
@@ -252,16 +393,22 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
 // process size.  Returns the new process size.
+// Pages are unmapped in batches, with one TLB shootdown per batch
+// before its pages are freed.  Swapped-out pages free their slots.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
   pte_t *pte;
-  uint a, pa;
+  uint a, pa, start;
+  char *batch[32];
+  int i, n;
 
   if(newsz >= oldsz)
     return oldsz;
 
   a = PGROUNDUP(newsz);
+  start = a;
+  n = 0;
   for(; a  < oldsz; a += PGSIZE){
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
@@ -270,16 +417,31 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      batch[n++] = P2V(pa);
+      *pte = 0;
+      rmapremove(P2V(pa), pgdir, a);
+      if(n == NELEM(batch)){
+        tlbflush(pgdir, start, a + PGSIZE - start);
+        for(i = 0; i < n; i++)
+          kfree(batch[i]);
+        n = 0;
+        start = a + PGSIZE;
+      }
+    } else if(*pte & PTE_SWAP){
+      swapfree(PTE_ADDR(*pte) / PGSIZE);
       *pte = 0;
     }
   }
+  if(n > 0){
+    tlbflush(pgdir, start, oldsz - start);
+    for(i = 0; i < n; i++)
+      kfree(batch[i]);
+  }
   return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  The kernel part is shared (see setupkvm).
 void
 freevm(pde_t *pgdir)
 {
@@ -288,7 +450,7 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -310,30 +472,64 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
-// Given a parent process's page table, create a copy
-// of it for a child.
+// Given the address space of group leader p, create a copy
+// of its page table for a fork child.  Rather than copying the
+// user pages, share them: writable pages lose PTE_W in both
+// page tables and gain PTE_COW, so the first write to one of
+// them faults and cowpage() gives the writer its own copy.
+// Pages of MAP_SHARED regions (PTE_SHARED) are shared as they
+// are.  Writable pages a system call has pinned (see pinuvm)
+// are copied now instead: the kernel may be writing them
+// holding a spinlock.  Swapped-out pages stay in their slots;
+// each process will read in its own copy.
+// The caller holds p's address space lock and must flush
+// p's TLB.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(struct proc *p)
 {
-  pde_t *d;
-  pte_t *pte;
+  pde_t *d, *pgdir;
+  pte_t *pte, *npte;
   uint pa, i, flags;
   char *mem;
 
+  pgdir = p->pgdir;
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+  for(i = 0; i < KERNBASE; i += PGSIZE){
+    // Pages the parent never touched are not allocated
+    // yet; the child will fault them in too.
+    if(!(pgdir[PDX(i)] & PTE_P)){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    pte = walkpgdir(pgdir, (void *) i, 0);
+    if(*pte & PTE_SWAP){
+      if((npte = walkpgdir(d, (void *) i, 1)) == 0)
+        goto bad;
+      *npte = *pte;
+      swapdup(PTE_ADDR(*pte) / PGSIZE);
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+    if((*pte & PTE_W) && !(*pte & PTE_SHARED)){
+      if(pinned(p, i, i + PGSIZE)){
+        if((mem = kallocswap(0)) == 0)
+          goto bad;
+        memmove(mem, P2V(PTE_ADDR(*pte)), PGSIZE);
+        if(mapuser(d, (void*)i, mem, PTE_FLAGS(*pte)) < 0){
+          kfree(mem);
+          goto bad;
+        }
+        continue;
+      }
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    }
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
+    kincref(P2V(pa));
+    if(mapuser(d, (void*)i, P2V(pa), flags) < 0){
+      kfree(P2V(pa));
       goto bad;
     }
   }
@@ -344,6 +540,370 @@ bad:
   return 0;
 }
 
+// Give pgdir a private, writable copy of the copy-on-write
+// page mapped by pte at user address va.  If no other page
+// table still maps the page, it is simply made writable again.
+// A copy of the zero page is just a zeroed page.
+// Returns 0 on success, -1 if out of memory.
+static int
+cowpage(pde_t *pgdir, pte_t *pte, char *va)
+{
+  uint pa, flags;
+  char *mem;
+  int zero;
+
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  zero = (P2V(pa) == kzeropage());
+  if(!zero && krefcount(P2V(pa)) == 1){
+    *pte = pa | flags;
+    tlbflush(pgdir, (uint)va, PGSIZE);
+    return 0;
+  }
+  if((mem = kallocswap(zero)) == 0)
+    return -1;
+  if(rmapadd(mem, pgdir, (uint)va) < 0){
+    kfree(mem);
+    return -1;
+  }
+  if(!zero)
+    memmove(mem, P2V(pa), PGSIZE);
+  *pte = V2P(mem) | flags;
+  tlbflush(pgdir, (uint)va, PGSIZE);  // before the old page can be reused
+  rmapremove(P2V(pa), pgdir, (uint)va);
+  kfree(P2V(pa));
+  return 0;
+}
+
+// Map a heap page at user address va in pgdir: the zero page,
+// copy-on-write, if the page is only being read, otherwise a
+// fresh zeroed page.  Returns 0 on success, -1 if out of memory.
+static int
+zeropage(pde_t *pgdir, char *va, int write)
+{
+  char *mem;
+
+  if(!write)
+    return mappages(pgdir, va, PGSIZE, V2P(kzeropage()), PTE_U|PTE_COW);
+  if((mem = kallocswap(1)) == 0)
+    return -1;
+  if(mapuser(pgdir, va, mem, PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Return the region of p's address space containing va, or 0.
+struct vma*
+findvma(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Map a page at user address va in pgdir holding the contents
+// region v gives that page: bytes from v->ip where the region
+// has file data, zeros elsewhere (including past the end of
+// the file).  A private page of zeros that is only being read
+// is the zero page, copy-on-write if the region is writable.
+// A region a segment backs maps the segment's page, which the
+// first process to touch it fills in.
+// Reads the inode through the buffer cache, so may sleep.
+// Returns 0 on success, -1 on error.
+static int
+vmapage(pde_t *pgdir, struct vma *v, char *va, int write)
+{
+  char *mem, *smem;
+  uint pgoff, n;
+  int perm;
+
+  pgoff = (uint)va - v->start;
+  if(!write && v->shm == 0 && !(v->flags & MAP_SHARED) &&
+     (v->ip == 0 || pgoff >= v->filesz)){
+    perm = PTE_U;
+    if(v->prot & PROT_WRITE)
+      perm |= PTE_COW;
+    return mappages(pgdir, va, PGSIZE, V2P(kzeropage()), perm);
+  }
+  if(v->shm && (mem = shmpage(v->shm, v->off + pgoff, 0)) != 0){
+    kincref(mem);
+    goto map;
+  }
+  if((mem = kallocswap(1)) == 0)
+    return -1;
+  if(v->ip && pgoff < v->filesz){
+    n = v->filesz - pgoff;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    ilock(v->ip);
+    if(v->off + pgoff < v->ip->size &&
+       readi(v->ip, mem, v->off + pgoff, n) < 0){
+      iunlock(v->ip);
+      kfree(mem);
+      return -1;
+    }
+    iunlock(v->ip);
+  }
+  if(v->shm){
+    // Another process may have added the page meanwhile.
+    if((smem = shmpage(v->shm, v->off + pgoff, mem)) != mem){
+      kfree(mem);
+      if((mem = smem) == 0)
+        return -1;
+    }
+    kincref(mem);
+  }
+map:
+  perm = PTE_U;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->flags & MAP_SHARED)
+    perm |= PTE_SHARED;
+  if(mapuser(pgdir, va, mem, perm) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Read the swapped-out page that pte, for user address va in
+// pgdir, refers to back into memory.  The page is private to
+// this page table from now on, so a copy-on-write page comes
+// back writable.  Returns 0 on success, -1 if out of memory.
+static int
+swappage(pde_t *pgdir, pte_t *pte, char *va)
+{
+  char *mem;
+  uint slot, flags;
+
+  if((mem = kallocswap(0)) == 0)
+    return -1;
+  if(rmapadd(mem, pgdir, (uint)va) < 0){
+    kfree(mem);
+    return -1;
+  }
+  slot = PTE_ADDR(*pte) / PGSIZE;
+  swapread(mem, slot);
+  flags = PTE_FLAGS(*pte) & (PTE_U|PTE_W|PTE_COW);
+  if(flags & PTE_COW)
+    flags = (flags | PTE_W) & ~PTE_COW;
+  *pte = V2P(mem) | flags | PTE_P;
+  swapfree(slot);
+  return 0;
+}
+
+#define NEVICT 8  // most mappings of a page evictpage() handles
+
+// Try to swap out the user page mem, which the swapper's clock
+// has reached; the caller holds a reference to it.  The page is
+// taken only if the swapper can lock every address space mapping
+// it without waiting, it is mapped by page tables alone, no
+// system call is using it (see pinuvm), and no thread is waiting
+// on a futex in it.  A page accessed since the clock last passed
+// loses PTE_A and stays.  Returns 1 if the page was evicted, 0 if
+// not, -1 if swap is full.
+int
+evictpage(char *mem)
+{
+  struct rmap map[NEVICT];
+  struct proc *owner[NEVICT];
+  pte_t *pte[NEVICT];
+  int i, n, locked, accessed, slot, r;
+
+  if((n = rmapget(mem, map, NEVICT)) <= 0)
+    return 0;
+  r = 0;
+  for(locked = 0; locked < n; locked++)
+    if((owner[locked] = lockpgdir(map[locked].pgdir)) == 0)
+      goto out;
+  // The mappings cannot change now; make sure they still
+  // are the ones we locked.
+  if(rmapget(mem, map, NEVICT) != n || krefcount(mem) != n + 1)
+    goto out;
+  accessed = 0;
+  for(i = 0; i < n; i++){
+    if(map[i].pgdir != owner[i]->pgdir)
+      goto out;
+    pte[i] = walkpgdir(map[i].pgdir, (char*)map[i].va, 0);
+    if(pte[i] == 0 || PTE_ADDR(*pte[i]) != V2P(mem) ||
+       (*pte[i] & (PTE_P|PTE_U)) != (PTE_P|PTE_U) ||
+       (*pte[i] & PTE_SHARED) ||
+       pinned(owner[i], map[i].va, map[i].va + PGSIZE) ||
+       futexwaiting(owner[i], map[i].va))
+      goto out;
+    if(*pte[i] & PTE_A){
+      // A stale TLB entry may keep the bit from being set
+      // again, which costs the page its second chance but
+      // nothing worse: eviction flushes the TLBs.
+      *pte[i] &= ~PTE_A;
+      accessed = 1;
+    }
+  }
+  if(accessed)
+    goto out;
+  if((slot = swapalloc()) < 0){
+    r = -1;
+    goto out;
+  }
+  for(i = 0; i < n; i++){
+    if(i > 0)
+      swapdup(slot);
+    *pte[i] = slot*PGSIZE | (PTE_FLAGS(*pte[i]) & (PTE_U|PTE_W|PTE_COW)) | PTE_SWAP;
+    tlbflush(map[i].pgdir, map[i].va, PGSIZE);  // before writing: no more stores
+    rmapremove(mem, map[i].pgdir, map[i].va);
+  }
+  swapwrite(mem, slot);
+  for(i = 0; i < n; i++)
+    kfree(mem);
+  r = 1;
+
+out:
+  for(i = 0; i < locked; i++)
+    unlockvm(owner[i]);
+  return r;
+}
+
+// Resolve a fault at address va in the address space of group
+// leader p, whose lock the caller holds; err is the error code
+// the hardware pushed.
+static int
+fault(struct proc *p, uint va, uint err)
+{
+  struct vma *v;
+  pte_t *pte;
+  char *a;
+
+  if(va >= KERNBASE)
+    return -1;
+  a = (char*)PGROUNDDOWN(va);
+  pte = walkpgdir(p->pgdir, a, 0);
+  if(pte && (*pte & PTE_SWAP))
+    return swappage(p->pgdir, pte, a);
+  if(pte == 0 || (*pte & PTE_P) == 0){
+    // exec() and mmap() record regions whose pages are
+    // read in on first touch.  growproc() only moves sz;
+    // heap pages are zero-filled on first touch.
+    if((v = findvma(p, va)) != 0)
+      return vmapage(p->pgdir, v, a, err & FEC_WR);
+    if(va >= p->sz)
+      return -1;
+    if(zeropage(p->pgdir, a, err & FEC_WR) < 0){
+      cprintf("pagefault out of memory\n");
+      return -1;
+    }
+    return 0;
+  }
+  if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+    return -1;
+  if((err & FEC_WR) && (*pte & PTE_W) == 0){
+    if(*pte & PTE_COW)
+      return cowpage(p->pgdir, pte, a);
+    return -1;
+  }
+  // Another thread resolved the fault first.
+  return 0;
+}
+
+// Resolve a page fault at address va taken by the current
+// process; err is the error code the hardware pushed.
+// Returns 0 if the faulting access can be retried,
+// -1 if it is a genuine fault.
+int
+pagefault(uint va, uint err)
+{
+  struct proc *curproc = myproc();
+  int r;
+
+  if(curproc == 0 || va >= KERNBASE)
+    return -1;
+  lockvm(curproc);
+  r = fault(curproc->leader, va, err);
+  unlockvm(curproc);
+  return r;
+}
+
+// Fault in any missing pages of [va, va+n) in the address
+// space of group leader p, whose lock the caller holds.
+// If write is set, also make sure the pages are writable,
+// copying any copy-on-write pages now.  Returns 0 on success,
+// -1 if the range is not accessible or a page could not be
+// allocated.
+int
+faultuvm(struct proc *p, uint va, uint n, int write)
+{
+  pte_t *pte;
+  uint a, last;
+
+  if(n == 0)
+    return 0;
+  a = PGROUNDDOWN(va);
+  last = PGROUNDDOWN(va + n - 1);
+  for(;;){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & PTE_P) == 0){
+      if(fault(p, a, 0) < 0)
+        return -1;
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+    }
+    if((*pte & PTE_U) == 0)
+      return -1;
+    if(write && (*pte & PTE_W) == 0 && fault(p, a, FEC_PR|FEC_WR) < 0)
+      return -1;
+    if(a == last)
+      break;
+    a += PGSIZE;
+  }
+  return 0;
+}
+
+// If the page at user address va in pgdir has been written
+// through this mapping since the last call, clear its dirty
+// bit and return its kernel address; otherwise return 0.
+char*
+uvmdirty(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_D)) != (PTE_P|PTE_D))
+    return 0;
+  *pte &= ~PTE_D;
+  tlbflush(pgdir, va, PGSIZE);
+  return (char*)P2V(PTE_ADDR(*pte));
+}
+
+// Count the user pages pgdir maps, shared ones, and swapped-out
+// ones, and its page-table pages, into ps.  The zero page does
+// not count as resident.
+void
+uvmstat(pde_t *pgdir, struct pstat *ps)
+{
+  pte_t *pgtab;
+  uint i, j;
+
+  ps->pgtab = 1;
+  for(i = 0; i < PDX(KERNBASE); i++){
+    if(!(pgdir[i] & PTE_P))
+      continue;
+    ps->pgtab++;
+    pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[i]));
+    for(j = 0; j < NPTENTRIES; j++){
+      if(pgtab[j] & PTE_SWAP)
+        ps->swap++;
+      if(!(pgtab[j] & PTE_P) || P2V(PTE_ADDR(pgtab[j])) == kzeropage())
+        continue;
+      ps->rss++;
+      if((pgtab[j] & PTE_SHARED) || krefcount(P2V(PTE_ADDR(pgtab[j]))) > 1)
+        ps->shared++;
+    }
+  }
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -352,6 +912,8 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
+  if(pte == 0)
+    return 0;
   if((*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
@@ -361,12 +923,16 @@ uva2ka(pde_t *pgdir, char *uva)
 
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
-// uva2ka ensures this only works for PTE_U pages.
+// uva2ka ensures this only works for PTE_U pages, and pages
+// that are neither writable nor copy-on-write are refused.
+// Copy-on-write pages are copied before being written, since
+// the kernel writes through its own mapping of the page.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
@@ -374,6 +940,14 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if((*pte & (PTE_W|PTE_COW)) == 0)
+      return -1;
+    if(*pte & PTE_COW){
+      if(cowpage(pgdir, pte, (char*)va0) < 0)
+        return -1;
+      pa0 = (char*)P2V(PTE_ADDR(*pte));
+    }
     n = PGSIZE - (va - va0);
     if(n > len)
       n = len;